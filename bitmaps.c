@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <time.h>
+
+#include "e2blk.h"
+
+/*
+ * 并行读取块和inode位图
+ *
+ * ext2fs_read_bitmaps reads group after group through fs->io. Here the
+ * groups are split between threads on flex group boundaries; each thread
+ * reads with its own descriptor and merges the bitmap blocks of adjacent
+ * groups, which flex_bg lays out back to back, into one pread of up to
+ * BITMAP_READ_BLOCKS blocks. Checksums are verified and uninitialized
+ * groups filled in as libext2fs does. Only copying into the in-memory
+ * bitmaps is serialized, the rbtree backend is not safe for concurrent
+ * writers.
+ *
+ * Anything unusual (bigalloc, e2image files, a read or checksum error) falls
+ * back to ext2fs_read_bitmaps, which then reports the error itself.
+ */
+
+#define BITMAP_READ_BLOCKS 256 // max bitmap blocks per read
+#define BITMAP_PROGRESS_NS 100000000ULL
+
+struct bitmap_load {
+    ext2_filsys fs;
+    pthread_mutex_t lock;
+    __u64 done; // bitmaps loaded, two per group
+    __u64 total;
+    __u64 reported; // time of the last progress call
+    void (*progress)(__u64 done, __u64 total);
+    errcode_t error;
+};
+
+struct bitmap_context {
+    struct bitmap_load *bl;
+    dgrp_t first_group, last_group;
+};
+
+static int group_uninit(ext2_filsys fs, dgrp_t g, int inode) {
+    return ext2fs_has_group_desc_csum(fs)
+        && ext2fs_bg_flags_test(fs, g, inode ? EXT2_BG_INODE_UNINIT : EXT2_BG_BLOCK_UNINIT);
+}
+
+static blk64_t bitmap_loc(ext2_filsys fs, dgrp_t g, int inode) {
+    return inode ? ext2fs_inode_bitmap_loc(fs, g) : ext2fs_block_bitmap_loc(fs, g);
+}
+
+static errcode_t read_full(int fd, void *buf, size_t size, off_t offset) {
+    ssize_t n;
+
+    sim_account(offset, size, 0);
+    while (size) {
+        n = pread(fd, buf, size, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        if (n == 0)
+            return EXT2_ET_SHORT_READ;
+        buf = (char *)buf + n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/*
+ * 未初始化的块组: only its own metadata is in use, wherever flex_bg put it.
+ * Done after all groups are read, like libext2fs, since the metadata may
+ * lie in a group whose bitmap is copied in later.
+ */
+static void mark_uninit_group(ext2_filsys fs, dgrp_t g) {
+    ext2fs_reserve_super_and_bgd(fs, g, fs->block_map);
+    ext2fs_mark_block_bitmap_range2(fs->block_map, ext2fs_inode_table_loc(fs, g), fs->inode_blocks_per_group);
+    ext2fs_mark_block_bitmap2(fs->block_map, ext2fs_block_bitmap_loc(fs, g));
+    ext2fs_mark_block_bitmap2(fs->block_map, ext2fs_inode_bitmap_loc(fs, g));
+}
+
+static __u64 now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* 调用时持有 bl->lock, 所以进度回调不会并发 */
+static void loaded(struct bitmap_load *bl, __u64 n) {
+    __u64 now;
+
+    bl->done += n;
+    if (!bl->progress)
+        return;
+    now = now_ns();
+    if (now - bl->reported >= BITMAP_PROGRESS_NS) {
+        bl->reported = now;
+        bl->progress(bl->done, bl->total);
+    }
+}
+
+/* 调用时持有 bl->lock */
+static errcode_t set_group(ext2_filsys fs, dgrp_t g, int inode, char *buf) {
+    __u32 ipg = EXT2_INODES_PER_GROUP(fs->super);
+    blk64_t first;
+
+    if (inode)
+        return ext2fs_set_inode_bitmap_range2(fs->inode_map, (__u64)g * ipg + 1, ipg, buf);
+    first = ext2fs_group_first_block2(fs, g);
+    return ext2fs_set_block_bitmap_range2(fs->block_map, first, ext2fs_group_last_block2(fs, g) - first + 1, buf);
+}
+
+static errcode_t read_groups(struct bitmap_context *ctx, int fd, char *buf, int inode) {
+    struct bitmap_load *bl = ctx->bl;
+    ext2_filsys fs = bl->fs;
+    blk64_t blocks = ext2fs_blocks_count(fs->super), loc;
+    int csum = ext2fs_has_feature_metadata_csum(fs->super) && !(fs->flags & EXT2_FLAG_IGNORE_CSUM_ERRORS);
+    int size = inode ? EXT2_INODES_PER_GROUP(fs->super) / 8 : EXT2_CLUSTERS_PER_GROUP(fs->super) / 8;
+    errcode_t retval = 0;
+    dgrp_t g, n, i;
+
+    for (g = ctx->first_group; g < ctx->last_group && !retval; g += n) {
+        n = 1;
+        loc = bitmap_loc(fs, g, inode);
+
+        /* 未初始化的组全部为0, 不用读盘 */
+        if (group_uninit(fs, g, inode) || !loc) {
+            pthread_mutex_lock(&bl->lock);
+            loaded(bl, 1);
+            retval = bl->error;
+            pthread_mutex_unlock(&bl->lock);
+            continue;
+        }
+
+        while (g + n < ctx->last_group && n < BITMAP_READ_BLOCKS && !group_uninit(fs, g + n, inode)
+               && bitmap_loc(fs, g + n, inode) == loc + n)
+            n++;
+        if (loc + n > blocks)
+            return inode ? EXT2_ET_GDESC_BAD_INODE_MAP : EXT2_ET_GDESC_BAD_BLOCK_MAP;
+        if (retval = read_full(fd, buf, (size_t)n * fs->blocksize, (off_t)loc * fs->blocksize))
+            return retval;
+
+        for (i = 0; i < n; i++) {
+            if (!csum)
+                continue;
+            if (inode ? !ext2fs_inode_bitmap_csum_verify(fs, g + i, buf + (size_t)i * fs->blocksize, size)
+                      : !ext2fs_block_bitmap_csum_verify(fs, g + i, buf + (size_t)i * fs->blocksize, size))
+                return inode ? EXT2_ET_INODE_BITMAP_CSUM_INVALID : EXT2_ET_BLOCK_BITMAP_CSUM_INVALID;
+        }
+
+        pthread_mutex_lock(&bl->lock);
+        for (i = 0; i < n && !retval; i++)
+            retval = set_group(fs, g + i, inode, buf + (size_t)i * fs->blocksize);
+        loaded(bl, n);
+        if (!retval)
+            retval = bl->error;
+        pthread_mutex_unlock(&bl->lock);
+    }
+
+    return retval;
+}
+
+static void *bitmap_proc(void *arg) {
+    struct bitmap_context *ctx = (struct bitmap_context *)arg;
+    struct bitmap_load *bl = ctx->bl;
+    ext2_filsys fs = bl->fs;
+    errcode_t retval;
+    char *buf = NULL;
+    __u64 ts = trace_now();
+    int fd;
+
+    fd = open(fs->device_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        retval = errno;
+        goto _exit;
+    }
+    if (retval = ext2fs_get_memalign((unsigned long)BITMAP_READ_BLOCKS * fs->blocksize, fs->blocksize, &buf))
+        goto _exit;
+    if (!(retval = read_groups(ctx, fd, buf, 0)))
+        retval = read_groups(ctx, fd, buf, 1);
+    trace_span("scan", "read_bitmaps_range", ts, "\"groups\":%u", ctx->last_group - ctx->first_group);
+
+_exit:
+    if (fd >= 0)
+        close(fd);
+    ext2fs_free_mem(&buf);
+
+    pthread_mutex_lock(&bl->lock);
+    if (retval && !bl->error)
+        bl->error = retval;
+    pthread_mutex_unlock(&bl->lock);
+    return NULL;
+}
+
+static errcode_t load_parallel(ext2_filsys fs, int nthreads, void (*progress)(__u64 done, __u64 total)) {
+    struct bitmap_load bl = {fs, PTHREAD_MUTEX_INITIALIZER};
+    struct bitmap_context *ctx = NULL;
+    dgrp_t flex = 1, g;
+    errcode_t retval;
+    int i;
+
+    if (ext2fs_has_feature_flex_bg(fs->super) && fs->super->s_log_groups_per_flex < 31)
+        flex = 1U << fs->super->s_log_groups_per_flex;
+
+    if ((retval = ext2fs_allocate_block_bitmap(fs, "block bitmap", &fs->block_map))
+        || (retval = ext2fs_allocate_inode_bitmap(fs, "inode bitmap", &fs->inode_map)))
+        goto _free;
+    if (retval = ext2fs_get_arrayzero(nthreads, sizeof(struct bitmap_context), &ctx))
+        goto _free;
+    bl.total = 2ULL * fs->group_desc_count;
+    bl.progress = progress;
+
+    /* 按flex组对齐, 同一组的位图块不被拆开 */
+    for (i = 0; i < nthreads; i++) {
+        ctx[i].bl = &bl;
+        ctx[i].first_group = (__u64)fs->group_desc_count * i / nthreads / flex * flex;
+        ctx[i].last_group = i == nthreads - 1 ? fs->group_desc_count
+                          : (__u64)fs->group_desc_count * (i + 1) / nthreads / flex * flex;
+    }
+
+    run_parallel(nthreads, bitmap_proc, ctx, sizeof(struct bitmap_context));
+    for (g = 0; !bl.error && g < fs->group_desc_count; g++)
+        if (group_uninit(fs, g, 0) && ext2fs_block_bitmap_loc(fs, g))
+            mark_uninit_group(fs, g);
+    if (progress)
+        progress(bl.done, bl.total);
+    retval = bl.error;
+
+_free:
+    ext2fs_free_mem(&ctx);
+    if (retval) {
+        ext2fs_free_block_bitmap(fs->block_map);
+        ext2fs_free_inode_bitmap(fs->inode_map);
+        fs->block_map = NULL;
+        fs->inode_map = NULL;
+    } else
+        fs->flags &= ~(EXT2_FLAG_BB_DIRTY | EXT2_FLAG_IB_DIRTY);
+    pthread_mutex_destroy(&bl.lock);
+    return retval;
+}
+
+static errcode_t load_maps(ext2_filsys fs, int nthreads, void (*progress)(__u64 done, __u64 total)) {
+    errcode_t retval;
+
+    if (nthreads >= 1 && !fs->block_map && !fs->inode_map && !ext2fs_has_feature_bigalloc(fs->super)
+        && !(fs->flags & EXT2_FLAG_IMAGE_FILE) && fs->device_name) {
+        if ((__u64)nthreads > fs->group_desc_count)
+            nthreads = fs->group_desc_count;
+        if (!(retval = load_parallel(fs, nthreads, progress)))
+            return 0;
+        trace_span("scan", "read_bitmaps_fallback", trace_now(), "\"error\":%ld", (long)retval);
+    }
+    return ext2fs_read_bitmaps(fs);
+}
+
+/*
+ * 用 `nthreads` 个线程读取位图, `progress` is called by the loading
+ * threads, one at a time, about ten times a second with the number of
+ * bitmaps loaded so far. Every caller goes through here, also when the
+ * bitmaps are already in memory, so the run map of the chosen
+ * representation is (re)built wherever they are first needed.
+ */
+errcode_t bitmaps_load(ext2_filsys fs, int nthreads, void (*progress)(__u64 done, __u64 total)) {
+    int loaded = !fs->block_map || !fs->inode_map;
+    errcode_t retval;
+
+    if (loaded && (retval = load_maps(fs, nthreads, progress)))
+        return retval;
+    bitmap_prepare(fs, loaded);
+    return 0;
+}
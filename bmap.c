@@ -0,0 +1,271 @@
+#include <time.h>
+
+#include "e2blk.h"
+
+/*
+ * 位图表示的选择
+ *
+ * libext2fs keeps a block bitmap either as a flat bit array (blocks / 8
+ * bytes, O(1) tests, range counts walk every word) or as an rbtree of used
+ * extents (about 40 bytes per extent, O(log n) tests). Which one is smaller
+ * and faster depends on how many used runs the filesystem has, so
+ * bitmap_choose() estimates that before the bitmaps are read: groups that
+ * the descriptors show as completely free, full or BLOCK_UNINIT are
+ * counted without I/O, a few of the mixed groups have their bitmap block
+ * read and the result is extrapolated to the others.
+ *
+ * With few runs the rbtree is used together with a run map, e2blk's own
+ * run-length structure: the used runs sorted by start with a prefix sum of
+ * their lengths, so bitmap_popcount() over any range is two binary
+ * searches instead of a walk of the bitmap.
+ */
+
+#define BMAP_SAMPLE_READS 16    // bitmap blocks read to sample mixed groups
+#define BMAP_RBTREE_EXTENT 40   // bytes of one rbtree extent (rb_node, start, count)
+#define BMAP_BENCH_TESTS 20000  // random lookups timed for the report
+#define BMAP_BENCH_RANGES 2000  // random range counts timed for the report
+#define BMAP_BENCH_RANGE 32768  // blocks per timed range count
+
+struct used_run {
+    blk64_t start;
+    __u64 before; // used blocks in the runs before this one
+    __u32 len;
+};
+
+int bitmap_mode = BMAP_AUTO;
+struct run_map *fs_runs = NULL;
+struct bitmap_choice fs_bitmap_choice;
+char bitmap_summary[256]; // report of the last load, until it is printed
+const char *bitmap_type_name[BMAP_RUNS + 1] = {"auto", "bitarray", "rbtree", "rbtree + run map"};
+
+/* 缓冲区前 `bits` 位中置位段的个数 */
+static __u64 count_runs(const unsigned char *buf, __u64 bits) {
+    __u64 runs = 0, i;
+    int prev = 0, cur;
+
+    for (i = 0; i < bits; i++) {
+        cur = buf[i / 8] >> (i % 8) & 1;
+        if (cur && !prev)
+            runs++;
+        prev = cur;
+    }
+    return runs;
+}
+
+/* 从描述符判断组的位图: 0全空, 1只有一段 (满或BLOCK_UNINIT), 2需要读盘 */
+static int group_kind(ext2_filsys fs, dgrp_t g, __u64 *bits) {
+    __u64 free = ext2fs_bg_free_blocks_count(fs, g);
+
+    *bits = (__u64)ext2fs_group_blocks_count(fs, g) >> fs->cluster_ratio_bits;
+    if (free >= *bits)
+        return 0;
+    if (free == 0 || (ext2fs_has_group_desc_csum(fs) && ext2fs_bg_flags_test(fs, g, EXT2_BG_BLOCK_UNINIT)))
+        return 1;
+    return 2;
+}
+
+/*
+ * 估算已用段数和各种表示的内存, 并设置 fs->default_bitmap_type.
+ * `mode` forces a representation, BMAP_AUTO picks the smallest one that
+ * still answers tests quickly.
+ */
+errcode_t bitmap_choose(ext2_filsys fs, int mode, struct bitmap_choice *ch) {
+    __u64 runs = 0, mixed = 0, sampled = 0, sampled_runs = 0, bits, clusters = 0, i, step;
+    unsigned char *buf;
+    errcode_t retval;
+    blk64_t loc;
+    dgrp_t g;
+
+    memset(ch, 0, sizeof(struct bitmap_choice));
+    ch->fs = fs;
+    if (retval = ext2fs_get_mem(fs->blocksize, &buf))
+        return retval;
+
+    for (g = 0; g < fs->group_desc_count; g++) {
+        switch (group_kind(fs, g, &bits)) {
+        case 1: runs++; break;
+        case 2: mixed++; break;
+        }
+        clusters += bits;
+    }
+
+    /* 均匀抽取部分混合组读取位图, 读不到的按一段计 */
+    step = mixed > BMAP_SAMPLE_READS ? mixed / BMAP_SAMPLE_READS : 1;
+    for (g = 0, i = 0; g < fs->group_desc_count && sampled < BMAP_SAMPLE_READS; g++) {
+        if (group_kind(fs, g, &bits) != 2 || i++ % step)
+            continue;
+        loc = ext2fs_block_bitmap_loc(fs, g);
+        if (!loc || io_channel_read_blk64(fs->io, loc, 1, buf))
+            continue;
+        sampled_runs += count_runs(buf, bits);
+        sampled++;
+    }
+    runs += sampled ? sampled_runs * mixed / sampled : mixed;
+    ext2fs_free_mem(&buf);
+
+    ch->runs = runs;
+    ch->mem[BMAP_BITARRAY] = (clusters + 7) / 8;
+    ch->mem[BMAP_RBTREE] = runs * BMAP_RBTREE_EXTENT;
+    ch->mem[BMAP_RUNS] = runs * (BMAP_RBTREE_EXTENT + sizeof(struct used_run));
+
+    /*
+     * 段多时位数组更小, 测试也是O(1); 段少到连同run map都远小于位数组时
+     * the range counts of the preview come from the run map.
+     */
+    ch->type = mode;
+    if (mode == BMAP_AUTO) {
+        if (ch->mem[BMAP_RBTREE] > ch->mem[BMAP_BITARRAY])
+            ch->type = BMAP_BITARRAY;
+        else if (ch->mem[BMAP_RUNS] * 8 <= ch->mem[BMAP_BITARRAY])
+            ch->type = BMAP_RUNS;
+        else
+            ch->type = BMAP_RBTREE;
+    }
+    fs->default_bitmap_type = ch->type == BMAP_BITARRAY ? EXT2FS_BMAP64_BITARRAY : EXT2FS_BMAP64_RBTREE;
+    return 0;
+}
+
+/* 从位图收集已用段 */
+errcode_t run_map_build(ext2_filsys fs, ext2fs_block_bitmap bmap, struct run_map **ret) {
+    blk64_t blk, end = ext2fs_blocks_count(fs->super) - 1, s, e;
+    struct run_map *rm;
+    __u64 size = 0, before = 0;
+    errcode_t retval;
+
+    if (retval = ext2fs_get_memzero(sizeof(struct run_map), &rm))
+        return retval;
+    rm->bmap = bmap;
+
+    for (blk = fs->super->s_first_data_block; blk <= end; blk = e) {
+        if (ext2fs_find_first_set_block_bitmap2(bmap, blk, end, &s))
+            break;
+        if (ext2fs_find_first_zero_block_bitmap2(bmap, s, end, &e))
+            e = end + 1;
+        /* 超长的段拆开, len是32位 */
+        if (e - s > 0x80000000ULL)
+            e = s + 0x80000000ULL;
+
+        if (rm->count == size) {
+            __u64 nsize = size ? size * 2 : 4096;
+            if (retval = spill_resize_array(sizeof(struct used_run), size, nsize, &rm->runs)) {
+                run_map_free(rm);
+                return retval;
+            }
+            size = nsize;
+        }
+        rm->runs[rm->count].start = s;
+        rm->runs[rm->count].len = e - s;
+        rm->runs[rm->count].before = before;
+        before += e - s;
+        rm->count++;
+    }
+
+    *ret = rm;
+    return 0;
+}
+
+void run_map_free(struct run_map *rm) {
+    if (!rm)
+        return;
+    spill_free(&rm->runs);
+    ext2fs_free_mem(&rm);
+}
+
+/* [0, blk) 中的已用块数 */
+static __u64 run_map_below(struct run_map *rm, blk64_t blk) {
+    __u64 lo = 0, hi = rm->count, mid;
+    struct used_run *r;
+
+    /* 最后一个 start < blk 的段 */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (rm->runs[mid].start < blk)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return 0;
+    r = rm->runs + lo - 1;
+    return r->before + (blk - r->start < r->len ? blk - r->start : r->len);
+}
+
+__u64 run_map_count(struct run_map *rm, blk64_t start, blk64_t end) {
+    if (end <= start)
+        return 0;
+    return run_map_below(rm, end) - run_map_below(rm, start);
+}
+
+static double bench_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * 一行说明: estimated memory of each representation and the measured cost
+ * of a lookup and of a BMAP_BENCH_RANGE block range count on the loaded
+ * bitmap.
+ */
+void bitmap_report(ext2_filsys fs, struct bitmap_choice *ch, char *buf, size_t size) {
+    blk64_t first = fs->super->s_first_data_block, blocks = ext2fs_blocks_count(fs->super), span;
+    __u64 x = 88172645463325252ULL;
+    volatile __u64 sum = 0; // 防止循环被优化掉
+    double t, test_ns = 0, range_ns = 0;
+    int i;
+
+    span = blocks > first ? blocks - first : 1;
+    if (fs->block_map) {
+        t = bench_now();
+        for (i = 0; i < BMAP_BENCH_TESTS; i++) {
+            x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+            sum += ext2fs_test_block_bitmap2(fs->block_map, first + x % span);
+        }
+        test_ns = (bench_now() - t) * 1e9 / BMAP_BENCH_TESTS;
+
+        t = bench_now();
+        for (i = 0; i < BMAP_BENCH_RANGES; i++) {
+            x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+            sum += bitmap_popcount(fs->block_map, first + x % span, BMAP_BENCH_RANGE);
+        }
+        range_ns = (bench_now() - t) * 1e9 / BMAP_BENCH_RANGES;
+    }
+
+    snprintf(buf, size, "Bitmap %s: ~%llu used runs, bitarray %.1f MB, rbtree %.1f MB, with run map %.1f MB; "
+             "lookup %.0f ns, %u block count %.0f ns",
+             bitmap_type_name[ch->type], (unsigned long long)ch->runs, ch->mem[BMAP_BITARRAY] / 1048576.0,
+             ch->mem[BMAP_RBTREE] / 1048576.0, ch->mem[BMAP_RUNS] / 1048576.0, test_ns, BMAP_BENCH_RANGE, range_ns);
+}
+
+/*
+ * 位图在内存中之后调用 (bitmaps_load): builds the run map of the chosen
+ * representation when it is missing, which is also the case after a move
+ * invalidated it, and writes the report to bitmap_summary when the
+ * bitmaps were just read (`loaded`) or the run map rebuilt. A run map that
+ * can not be built only costs speed, bitmap_popcount() falls back to the
+ * bitmap.
+ */
+void bitmap_prepare(ext2_filsys fs, int loaded) {
+    struct bitmap_choice *ch = &fs_bitmap_choice;
+    errcode_t retval = 0;
+    size_t n;
+
+    if (ch->fs != fs || !fs->block_map)
+        return;
+    if (ch->type == BMAP_RUNS && !fs_runs) {
+        __u64 ts = trace_now();
+
+        retval = run_map_build(fs, fs->block_map, &fs_runs);
+        trace_span("scan", "run_map_build", ts, "\"error\":%ld", (long)retval);
+        loaded = 1;
+    }
+    if (!loaded)
+        return;
+
+    bitmap_report(fs, ch, bitmap_summary, sizeof(bitmap_summary));
+    n = strlen(bitmap_summary);
+    if (retval)
+        snprintf(bitmap_summary + n, sizeof(bitmap_summary) - n, "; run map: %s", error_message(retval));
+    trace_span("scan", "bitmap_report", trace_now(), "\"runs\":%llu", (unsigned long long)ch->runs);
+}
@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+
+#include "e2blk.h"
+
+/*
+ * 拷贝缓冲池
+ *
+ * The copy workers and the verifier each hold one batch buffer
+ * (MOVE_BATCH_BLOCKS blocks) for a whole move. The buffers are carved out
+ * of one anonymous mapping made before the threads start and kept for the
+ * rest of the session, so a second move in the same run allocates
+ * nothing. Every buffer starts on a page boundary, which also satisfies
+ * the sector alignment O_DIRECT needs. With buf_pool_hugepages the mapping
+ * is taken from hugetlbfs, or failing that marked for transparent huge
+ * pages, to save TLB misses on the large transfers.
+ */
+
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+int buf_pool_hugepages = 0;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static char *pool_base = NULL;
+static size_t pool_len = 0;  // mapped bytes
+static size_t pool_size = 0; // bytes per buffer
+static int pool_count = 0;
+static char **pool_free = NULL; // stack of free buffers
+static int pool_nfree = 0;
+
+static void pool_unmap(void) {
+    if (pool_base)
+        munmap(pool_base, pool_len);
+    ext2fs_free_mem(&pool_free);
+    pool_base = NULL;
+    pool_len = pool_size = 0;
+    pool_count = pool_nfree = 0;
+}
+
+/*
+ * 准备 `count` 个至少 `size` 字节的缓冲区. A pool that is already large
+ * enough is reused as is; it can only be rebuilt while no buffer is out.
+ */
+errcode_t buf_pool_init(int count, size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE), len;
+    errcode_t retval = 0;
+    void *addr = MAP_FAILED;
+    int i;
+
+    pthread_mutex_lock(&pool_lock);
+    if (pool_base && pool_count >= count && pool_size >= size)
+        goto _unlock;
+    if (pool_nfree != pool_count) {
+        retval = EBUSY;
+        goto _unlock;
+    }
+    pool_unmap();
+
+    size = (size + page - 1) / page * page;
+    len = size * count;
+    if (buf_pool_hugepages) {
+        len = (len + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (addr == MAP_FAILED) {
+        addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            retval = errno;
+            goto _unlock;
+        }
+        /* 没有预留的大页时退回透明大页 */
+        if (buf_pool_hugepages)
+            madvise(addr, len, MADV_HUGEPAGE);
+    }
+
+    if (retval = ext2fs_get_array(count, sizeof(char *), &pool_free)) {
+        munmap(addr, len);
+        goto _unlock;
+    }
+    pool_base = addr;
+    pool_len = len;
+    pool_size = size;
+    pool_count = pool_nfree = count;
+    for (i = 0; i < count; i++)
+        pool_free[i] = pool_base + (size_t)(count - 1 - i) * size;
+
+_unlock:
+    pthread_mutex_unlock(&pool_lock);
+    return retval;
+}
+
+/* 取一个缓冲区, 池空时等待归还 */
+char *buf_pool_get(void) {
+    char *buf = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    while (pool_count && !pool_nfree)
+        pthread_cond_wait(&pool_cond, &pool_lock);
+    if (pool_nfree)
+        buf = pool_free[--pool_nfree];
+    pthread_mutex_unlock(&pool_lock);
+    return buf;
+}
+
+void buf_pool_put(char *buf) {
+    if (!buf)
+        return;
+    pthread_mutex_lock(&pool_lock);
+    pool_free[pool_nfree++] = buf;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void buf_pool_free(void) {
+    pthread_mutex_lock(&pool_lock);
+    pool_unmap();
+    pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,377 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "e2blk.h"
+
+/*
+ * 扫描缓存
+ *
+ * The density pyramid, the extent index and the fragmentation stats are
+ * saved to a versioned file: a header keyed by the
+ * filesystem UUID, s_wtime, s_mtime and s_kbytes_written, a section table and
+ * the raw arrays, each section 8-byte aligned. A relaunch on an unchanged
+ * volume maps the file and points the in-memory structures into it, nothing
+ * is parsed or copied. The file is in host byte order, it is a local cache.
+ */
+
+#define CACHE_MAGIC 0x43423245 // "E2BC"
+#define CACHE_VERSION 1
+#define CACHE_ALIGN(n) (((n) + 7) & ~7ULL)
+
+enum {
+    CACHE_DENSITY = 1,
+    CACHE_INDEX,
+    CACHE_FRAG,
+};
+
+#define CACHE_HAS(type) (1 << (type))
+
+struct cache_header {
+    __u32 magic;
+    __u32 version;
+    __u8 uuid[16];
+    __u32 wtime;
+    __u32 mtime;
+    __u64 kbytes_written;
+    __u64 blocks_count;
+    __u32 block_size;
+    __u32 nsections;
+};
+
+struct cache_section {
+    __u32 type;
+    __u32 rec_size; // element size, checked on load
+    __u64 offset;
+    __u64 size;
+};
+
+struct cache_density {
+    __u64 blocks;
+    __u32 shift;
+    __u32 levels;
+    __u64 count[DENSITY_MAX_LEVELS];
+};
+
+struct cache_index {
+    __u64 count;
+    __u32 max_len;
+    __u32 inodes;
+};
+
+static void *cache_map = NULL;
+static size_t cache_size = 0;
+static int cache_loaded = 0; // CACHE_HAS() of the sections in the mapped file
+static int cache_stale = 0;  // the filesystem was modified, do not save
+
+static void cache_key(ext2_filsys fs, struct cache_header *hdr) {
+    memset(hdr, 0, sizeof(struct cache_header));
+    hdr->magic = CACHE_MAGIC;
+    hdr->version = CACHE_VERSION;
+    memcpy(hdr->uuid, fs->super->s_uuid, sizeof(hdr->uuid));
+    hdr->wtime = fs->super->s_wtime;
+    hdr->mtime = fs->super->s_mtime;
+    hdr->kbytes_written = fs->super->s_kbytes_written;
+    hdr->blocks_count = ext2fs_blocks_count(fs->super);
+    hdr->block_size = EXT2_BLOCK_SIZE(fs->super);
+}
+
+static errcode_t load_density(struct cache_section *sec) {
+    struct cache_density *cd = (struct cache_density *)((char *)cache_map + sec->offset);
+    struct density_map *dm;
+    __u64 off = sizeof(struct cache_density);
+    errcode_t retval;
+    int l;
+
+    if (sec->size < off || cd->levels == 0 || cd->levels > DENSITY_MAX_LEVELS || sec->rec_size != sizeof(__u32))
+        return ESTALE;
+    if (retval = ext2fs_get_memzero(sizeof(struct density_map), &dm))
+        return retval;
+
+    dm->blocks = cd->blocks;
+    dm->shift = cd->shift;
+    dm->levels = cd->levels;
+    dm->mapped = 1;
+    for (l = 0; l < dm->levels; l++) {
+        dm->count[l] = cd->count[l];
+        if (off + dm->count[l] * sizeof(__u32) > sec->size) {
+            density_free(dm);
+            return ESTALE;
+        }
+        dm->level[l] = (__u32 *)((char *)cd + off);
+        off += CACHE_ALIGN(dm->count[l] * sizeof(__u32));
+    }
+
+    fs_density = dm;
+    return 0;
+}
+
+static errcode_t load_index(struct cache_section *sec) {
+    struct cache_index *ci = (struct cache_index *)((char *)cache_map + sec->offset);
+    struct extent_index *idx;
+    errcode_t retval;
+
+    if (sec->size < sizeof(struct cache_index) || sec->rec_size != sizeof(struct extent_rec)
+        || sizeof(struct cache_index) + ci->count * sizeof(struct extent_rec) > sec->size)
+        return ESTALE;
+    if (retval = ext2fs_get_memzero(sizeof(struct extent_index), &idx))
+        return retval;
+
+    idx->recs = (struct extent_rec *)(ci + 1);
+    idx->count = idx->size = ci->count;
+    idx->max_len = ci->max_len;
+    idx->inodes = ci->inodes;
+    idx->mapped = 1;
+
+    fs_index = idx;
+    return 0;
+}
+
+static errcode_t load_frag(struct cache_section *sec) {
+    errcode_t retval;
+
+    if (sec->size != sizeof(struct frag_stats) || sec->rec_size != sizeof(struct frag_stats))
+        return ESTALE;
+    if (retval = ext2fs_get_mem(sizeof(struct frag_stats), &fs_frag))
+        return retval;
+    memcpy(fs_frag, (char *)cache_map + sec->offset, sizeof(struct frag_stats));
+    return 0;
+}
+
+/*
+ * 载入扫描缓存. Returns ESTALE when the file does not belong to this
+ * filesystem state, the caller then scans as usual.
+ */
+errcode_t cache_load(ext2_filsys fs, const char *path) {
+    struct cache_header key, *hdr;
+    struct cache_section *sec;
+    errcode_t retval = 0;
+    struct stat st;
+    __u32 i;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return errno;
+    if (fstat(fd, &st) < 0) {
+        retval = errno;
+        goto _close;
+    }
+    if (st.st_size < sizeof(struct cache_header)) {
+        retval = ESTALE;
+        goto _close;
+    }
+
+    /* MAP_PRIVATE: 写时复制, 文件本身不会被修改 */
+    cache_size = st.st_size;
+    cache_map = mmap(NULL, cache_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (cache_map == MAP_FAILED) {
+        retval = errno;
+        cache_map = NULL;
+        goto _close;
+    }
+
+    hdr = cache_map;
+    cache_key(fs, &key);
+    key.nsections = hdr->nsections;
+    if (memcmp(hdr, &key, sizeof(key))
+        || sizeof(struct cache_header) + (__u64)hdr->nsections * sizeof(struct cache_section) > cache_size) {
+        retval = ESTALE;
+        goto _unmap;
+    }
+
+    sec = (struct cache_section *)(hdr + 1);
+    for (i = 0; i < hdr->nsections && !retval; i++, sec++) {
+        if (sec->offset % 8 || sec->offset > cache_size || sec->size > cache_size - sec->offset) {
+            retval = ESTALE;
+            break;
+        }
+        switch (sec->type) {
+        case CACHE_DENSITY: retval = fs_density ? 0 : load_density(sec); break;
+        case CACHE_INDEX: retval = fs_index ? 0 : load_index(sec); break;
+        case CACHE_FRAG: retval = fs_frag ? 0 : load_frag(sec); break;
+        default: continue; // 新版本的段
+        }
+        if (!retval)
+            cache_loaded |= CACHE_HAS(sec->type);
+    }
+    if (retval) {
+        cache_invalidate();
+        cache_stale = 0;
+        goto _unmap;
+    }
+
+    close(fd);
+    return 0;
+
+_unmap:
+    munmap(cache_map, cache_size);
+    cache_map = NULL;
+    cache_loaded = 0;
+_close:
+    close(fd);
+    return retval;
+}
+
+static errcode_t write_all(FILE *f, const void *buf, size_t size, __u64 *pos) {
+    static const char pad[8];
+    size_t n = CACHE_ALIGN(size) - size;
+
+    if (size && fwrite(buf, size, 1, f) != 1)
+        return errno ? errno : EXT2_ET_SHORT_WRITE;
+    if (n && fwrite(pad, n, 1, f) != 1)
+        return errno ? errno : EXT2_ET_SHORT_WRITE;
+    *pos += size + n;
+    return 0;
+}
+
+/*
+ * 保存扫描缓存. Only when something was computed in this run and the
+ * filesystem has not been modified; written to `path`.tmp and renamed so a
+ * reader never sees a partial file.
+ */
+errcode_t cache_save(ext2_filsys fs, const char *path) {
+    struct cache_section secs[3], *sec = secs;
+    struct cache_density cd = {0};
+    struct cache_index ci = {0};
+    struct cache_header hdr;
+    errcode_t retval = 0;
+    char *tmp = NULL;
+    __u64 pos = 0, off;
+    FILE *f;
+    int l, has = 0;
+
+    if (cache_stale)
+        return 0;
+    if (fs_density)
+        has |= CACHE_HAS(CACHE_DENSITY);
+    if (fs_index)
+        has |= CACHE_HAS(CACHE_INDEX);
+    if (fs_frag)
+        has |= CACHE_HAS(CACHE_FRAG);
+    if (!(has & ~cache_loaded))
+        return 0;
+
+    cache_key(fs, &hdr);
+    off = CACHE_ALIGN(sizeof(hdr)) + sizeof(secs);
+    if (fs_density) {
+        cd.blocks = fs_density->blocks;
+        cd.shift = fs_density->shift;
+        cd.levels = fs_density->levels;
+        sec->type = CACHE_DENSITY;
+        sec->rec_size = sizeof(__u32);
+        sec->offset = off;
+        sec->size = sizeof(cd);
+        for (l = 0; l < fs_density->levels; l++) {
+            cd.count[l] = fs_density->count[l];
+            sec->size += CACHE_ALIGN(cd.count[l] * sizeof(__u32));
+        }
+        off += CACHE_ALIGN(sec->size);
+        sec++;
+    }
+    if (fs_index) {
+        ci.count = fs_index->count;
+        ci.max_len = fs_index->max_len;
+        ci.inodes = fs_index->inodes;
+        sec->type = CACHE_INDEX;
+        sec->rec_size = sizeof(struct extent_rec);
+        sec->offset = off;
+        sec->size = sizeof(ci) + ci.count * sizeof(struct extent_rec);
+        off += CACHE_ALIGN(sec->size);
+        sec++;
+    }
+    if (fs_frag) {
+        sec->type = CACHE_FRAG;
+        sec->rec_size = sizeof(struct frag_stats);
+        sec->offset = off;
+        sec->size = sizeof(struct frag_stats);
+        off += CACHE_ALIGN(sec->size);
+        sec++;
+    }
+    hdr.nsections = sec - secs;
+
+    if (retval = ext2fs_get_mem(strlen(path) + 5, &tmp))
+        return retval;
+    sprintf(tmp, "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (!f) {
+        retval = errno;
+        goto _free;
+    }
+
+    if (retval = write_all(f, &hdr, sizeof(hdr), &pos))
+        goto _error;
+    memset(sec, 0, (char *)(secs + ARRAY_SIZE(secs)) - (char *)sec);
+    if (retval = write_all(f, secs, sizeof(secs), &pos))
+        goto _error;
+    if (fs_density) {
+        if (retval = write_all(f, &cd, sizeof(cd), &pos))
+            goto _error;
+        for (l = 0; l < fs_density->levels; l++)
+            if (retval = write_all(f, fs_density->level[l], fs_density->count[l] * sizeof(__u32), &pos))
+                goto _error;
+    }
+    if (fs_index) {
+        if (retval = write_all(f, &ci, sizeof(ci), &pos))
+            goto _error;
+        if (retval = write_all(f, fs_index->recs, ci.count * sizeof(struct extent_rec), &pos))
+            goto _error;
+    }
+    if (fs_frag && (retval = write_all(f, fs_frag, sizeof(struct frag_stats), &pos)))
+        goto _error;
+
+    if (fflush(f) || fsync(fileno(f))) {
+        retval = errno;
+        goto _error;
+    }
+    if (fclose(f)) {
+        retval = errno;
+        f = NULL;
+        goto _error;
+    }
+    if (rename(tmp, path) < 0) {
+        retval = errno;
+        unlink(tmp);
+    }
+    goto _free;
+
+_error:
+    if (f)
+        fclose(f);
+    unlink(tmp);
+_free:
+    ext2fs_free_mem(&tmp);
+    return retval;
+}
+
+/* 文件系统已被修改: 丢弃所有扫描结果, 退出时也不再保存 */
+void cache_invalidate(void) {
+    extent_index_free(fs_index);
+    fs_index = NULL;
+    density_free(fs_density);
+    fs_density = NULL;
+    if (fs_frag)
+        ext2fs_free_mem(&fs_frag);
+    class_map_free(fs_classes);
+    fs_classes = NULL;
+    run_map_free(fs_runs);
+    fs_runs = NULL;
+    cache_stale = 1;
+}
+
+void cache_close(void) {
+    extent_index_free(fs_index);
+    fs_index = NULL;
+    density_free(fs_density);
+    fs_density = NULL;
+    if (fs_frag)
+        ext2fs_free_mem(&fs_frag);
+    class_map_free(fs_classes);
+    fs_classes = NULL;
+    run_map_free(fs_runs);
+    fs_runs = NULL;
+    if (cache_map)
+        munmap(cache_map, cache_size);
+    cache_map = NULL;
+    cache_loaded = 0;
+}
@@ -0,0 +1,225 @@
+#include "e2blk.h"
+
+/*
+ * 块分类
+ *
+ * Run-length intervals of (start, len, class), sorted and non-overlapping.
+ * Static metadata comes from the group descriptors, everything else from
+ * the extent index, so building the map costs no I/O once the index
+ * exists. A filesystem has a few runs per group plus one per extent,
+ * against 3 bits per block for a packed array.
+ */
+
+struct class_map *fs_classes = NULL;
+
+const char *block_class_name[BCLASS_MAX] = {
+    [BCLASS_FREE] = "free",
+    [BCLASS_SUPER] = "superblock/GDT",
+    [BCLASS_BITMAP] = "bitmaps",
+    [BCLASS_ITABLE] = "inode tables",
+    [BCLASS_JOURNAL] = "journal",
+    [BCLASS_DIR] = "directories",
+    [BCLASS_DATA] = "file data",
+    [BCLASS_META] = "extent tree/xattr",
+    [BCLASS_RESERVED] = "reserved inodes",
+};
+
+static errcode_t add_run(struct class_map *cm, blk64_t start, blk64_t len, __u8 cls) {
+    struct class_run *r;
+    errcode_t retval;
+
+    while (len) {
+        if (cm->count == cm->size) {
+            __u64 size = cm->size ? cm->size * 2 : 1024;
+            if (retval = ext2fs_resize_array(sizeof(struct class_run), cm->size, size, &cm->runs))
+                return retval;
+            cm->size = size;
+        }
+        r = cm->runs + cm->count++;
+        r->start = start;
+        r->len = len > 0xFFFFFFFFULL ? 0xFFFFFFFFU : (__u32)len;
+        r->cls = cls;
+        start += r->len;
+        len -= r->len;
+    }
+    return 0;
+}
+
+static int class_run_cmp(const void *a, const void *b) {
+    const struct class_run *ra = a, *rb = b;
+
+    if (ra->start != rb->start)
+        return ra->start < rb->start ? -1 : 1;
+    return ra->cls - rb->cls;
+}
+
+static __u8 rec_class(ext2_filsys fs, const struct extent_rec *r) {
+    if (r->ino == fs->super->s_journal_inum)
+        return BCLASS_JOURNAL;
+    /* resize inode映射的是预留GDT块 */
+    if (r->ino == EXT2_RESIZE_INO)
+        return BCLASS_SUPER;
+    if (r->flags & EREC_RSV)
+        return BCLASS_RESERVED;
+    if (r->flags & EREC_META)
+        return BCLASS_META;
+    if (r->flags & EREC_DIR)
+        return BCLASS_DIR;
+    return BCLASS_DATA;
+}
+
+/*
+ * 排序后裁掉重叠部分并合并相邻的同类区间.
+ * On overlap the run that starts first keeps the shared blocks, of runs
+ * starting at the same block the one with the lower class.
+ */
+static void normalize(struct class_map *cm) {
+    struct class_run *r, *last = NULL;
+    blk64_t end;
+    __u64 i, n = 0;
+
+    qsort(cm->runs, cm->count, sizeof(struct class_run), class_run_cmp);
+    for (i = 0; i < cm->count; i++) {
+        r = cm->runs + i;
+        if (last) {
+            end = last->start + last->len;
+            if (r->start + r->len <= end)
+                continue;
+            if (r->start < end) {
+                r->len -= end - r->start;
+                r->start = end;
+            }
+            if (r->start == end && r->cls == last->cls && (__u64)last->len + r->len <= 0xFFFFFFFFULL) {
+                last->len += r->len;
+                continue;
+            }
+        }
+        cm->runs[n] = *r;
+        last = cm->runs + n++;
+    }
+    cm->count = n;
+}
+
+errcode_t class_map_build(ext2_filsys fs, struct extent_index *idx, struct class_map **ret) {
+    blk64_t super, old_desc, new_desc, blk;
+    struct class_map *cm;
+    errcode_t retval;
+    blk_t used;
+    dgrp_t g;
+    __u64 i;
+
+    if (retval = ext2fs_get_memzero(sizeof(struct class_map), &cm))
+        return retval;
+
+    for (g = 0; g < fs->group_desc_count; g++) {
+        if (retval = ext2fs_super_and_bgd_loc2(fs, g, &super, &old_desc, &new_desc, &used))
+            goto _error;
+        /* 4K块的0号组超级块在块0 */
+        if (super || g == 0) {
+            if (retval = add_run(cm, super, 1, BCLASS_SUPER))
+                goto _error;
+            used--;
+        }
+        if (new_desc) {
+            if (retval = add_run(cm, new_desc, 1, BCLASS_SUPER))
+                goto _error;
+            used--;
+        }
+        if (old_desc && used && (retval = add_run(cm, old_desc, used, BCLASS_SUPER)))
+            goto _error;
+
+        if ((blk = ext2fs_block_bitmap_loc(fs, g)) && (retval = add_run(cm, blk, 1, BCLASS_BITMAP)))
+            goto _error;
+        if ((blk = ext2fs_inode_bitmap_loc(fs, g)) && (retval = add_run(cm, blk, 1, BCLASS_BITMAP)))
+            goto _error;
+        if ((blk = ext2fs_inode_table_loc(fs, g))
+            && (retval = add_run(cm, blk, fs->inode_blocks_per_group, BCLASS_ITABLE)))
+            goto _error;
+    }
+
+    for (i = 0; i < idx->count; i++)
+        if (retval = add_run(cm, idx->recs[i].pblk, idx->recs[i].len, rec_class(fs, idx->recs + i)))
+            goto _error;
+
+    normalize(cm);
+    *ret = cm;
+    return 0;
+
+_error:
+    class_map_free(cm);
+    return retval;
+}
+
+void class_map_free(struct class_map *cm) {
+    if (!cm)
+        return;
+    ext2fs_free_mem(&cm->runs);
+    ext2fs_free_mem(&cm);
+}
+
+/* 最后一个 start <= blk 的区间 */
+static __u64 class_map_find(struct class_map *cm, blk64_t blk) {
+    __u64 lo = 0, hi = cm->count, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (cm->runs[mid].start <= blk)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo ? lo - 1 : 0;
+}
+
+int class_map_get(struct class_map *cm, blk64_t blk) {
+    struct class_run *r;
+
+    if (!cm->count)
+        return BCLASS_FREE;
+    r = cm->runs + class_map_find(cm, blk);
+    if (blk >= r->start && blk < r->start + r->len)
+        return r->cls;
+    return BCLASS_FREE;
+}
+
+/* 累加 [start, end) 内各类的块数, 不属于任何区间的计入BCLASS_FREE */
+void class_map_count(struct class_map *cm, blk64_t start, blk64_t end, __u64 counts[BCLASS_MAX]) {
+    struct class_run *r;
+    blk64_t s, e, covered = 0;
+    __u64 i;
+
+    if (start >= end)
+        return;
+    for (i = cm->count ? class_map_find(cm, start) : 0; i < cm->count; i++) {
+        r = cm->runs + i;
+        if (r->start >= end)
+            break;
+        s = r->start > start ? r->start : start;
+        e = r->start + r->len < end ? r->start + r->len : end;
+        if (s >= e)
+            continue;
+        counts[r->cls] += e - s;
+        covered += e - s;
+    }
+    counts[BCLASS_FREE] += end - start - covered;
+}
+
+/* 占用最多的已用类别, 没有分类的已用块按文件数据计 */
+int class_map_dominant(__u64 counts[BCLASS_MAX], __u64 used) {
+    __u64 classified = 0, n, max = 0;
+    int c, best = BCLASS_FREE;
+
+    for (c = BCLASS_FREE + 1; c < BCLASS_MAX; c++)
+        classified += counts[c];
+    for (c = BCLASS_FREE + 1; c < BCLASS_MAX; c++) {
+        n = counts[c];
+        if (c == BCLASS_DATA && used > classified)
+            n += used - classified;
+        if (n > max) {
+            max = n;
+            best = c;
+        }
+    }
+
+    return best;
+}
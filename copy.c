@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+
+#include "e2blk.h"
+
+/*
+ * 数据拷贝通道
+ *
+ * Move workers do not go through fs->io: libext2fs is not thread-safe, so
+ * every worker opens its own descriptor on the device and copies runs with
+ * pread/pwrite. Only the committer thread touches the ext2_filsys.
+ * With COPY_DIRECT (-D) the descriptor is O_DIRECT, callers pass buffers
+ * from the page aligned pool in bufpool.c.
+ */
+
+errcode_t copy_open(const char *name, unsigned int blocksize, int flags, struct copy_channel **ret) {
+    struct copy_channel *cc;
+    struct stat st;
+    errcode_t retval;
+    int open_flags = O_RDWR, ssz;
+
+    if (retval = ext2fs_get_memzero(sizeof(struct copy_channel), &cc))
+        return retval;
+
+    cc->blocksize = blocksize;
+    cc->flags = flags;
+    if (flags & COPY_DIRECT)
+        open_flags |= O_DIRECT;
+    cc->fd = open(name, open_flags);
+    /* tmpfs等不支持O_DIRECT */
+    if (cc->fd < 0 && errno == EINVAL && (flags & COPY_DIRECT)) {
+        cc->flags &= ~COPY_DIRECT;
+        cc->fd = open(name, O_RDWR);
+    }
+    if (cc->fd < 0) {
+        retval = errno;
+        ext2fs_free_mem(&cc);
+        return retval;
+    }
+
+    /* 块大小不是扇区的整数倍时不能直接I/O */
+    if ((cc->flags & COPY_DIRECT) && fstat(cc->fd, &st) == 0 && S_ISBLK(st.st_mode)
+        && ioctl(cc->fd, BLKSSZGET, &ssz) == 0 && ssz > 0 && blocksize % ssz) {
+        fcntl(cc->fd, F_SETFL, fcntl(cc->fd, F_GETFL) & ~O_DIRECT);
+        cc->flags &= ~COPY_DIRECT;
+    }
+
+    /* 镜像文件: 宿主文件系统可能支持reflink或copy_file_range */
+    if (fstat(cc->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        cc->flags |= COPY_CLONE | COPY_RANGE;
+        cc->clone_align = st.st_blksize > 0 ? st.st_blksize : 4096;
+    }
+
+    *ret = cc;
+    return 0;
+}
+
+/*
+ * 直接I/O被拒绝 (EINVAL): an image file on a host filesystem with larger
+ * sectors than the block size, which open does not detect. Drops
+ * O_DIRECT for the rest of the move so the caller can retry buffered.
+ */
+static int direct_rejected(struct copy_channel *cc, int err) {
+    if (err != EINVAL || !(cc->flags & COPY_DIRECT))
+        return 0;
+    if (fcntl(cc->fd, F_SETFL, fcntl(cc->fd, F_GETFL) & ~O_DIRECT) < 0)
+        return 0;
+    cc->flags &= ~COPY_DIRECT;
+    return 1;
+}
+
+void copy_close(struct copy_channel *cc) {
+    if (!cc)
+        return;
+    if (cc->fd >= 0)
+        close(cc->fd);
+    ext2fs_free_mem(&cc);
+}
+
+errcode_t copy_read(struct copy_channel *cc, blk64_t blk, __u32 count, void *buf) {
+    size_t size = (size_t)count * cc->blocksize;
+    off_t offset = (off_t)blk * cc->blocksize;
+    ssize_t n;
+
+    sim_account(offset, size, 0);
+    while (size) {
+        n = pread(cc->fd, buf, size, offset);
+        if (n < 0) {
+            if (errno == EINTR || direct_rejected(cc, errno))
+                continue;
+            return errno;
+        }
+        if (n == 0)
+            return EXT2_ET_SHORT_READ;
+        buf = (char *)buf + n;
+        offset += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+static int offload_unsupported(int err) {
+    return err == EOPNOTSUPP || err == ENOSYS || err == EXDEV || err == EINVAL || err == ENOTTY;
+}
+
+/*
+ * 在镜像文件内部拷贝, 数据不经过用户态.
+ * FICLONERANGE shares the extents on XFS/btrfs when the range is aligned to
+ * the host block size, copy_file_range lets the kernel (or the host
+ * filesystem) do the copy otherwise. Returns EXT2_ET_UNIMPLEMENTED when the
+ * caller has to fall back to copy_read/copy_write; a method that fails once
+ * is not tried again on this channel.
+ */
+errcode_t copy_offload(struct copy_channel *cc, blk64_t src, blk64_t dst, __u32 count, int *cloned) {
+    loff_t off_in = (loff_t)src * cc->blocksize, off_out = (loff_t)dst * cc->blocksize;
+    size_t size = (size_t)count * cc->blocksize;
+    ssize_t n;
+
+    *cloned = 0;
+    if ((cc->flags & COPY_CLONE) && off_in % cc->clone_align == 0
+        && off_out % cc->clone_align == 0 && size % cc->clone_align == 0) {
+        struct file_clone_range range = {
+            .src_fd = cc->fd,
+            .src_offset = off_in,
+            .src_length = size,
+            .dest_offset = off_out,
+        };
+
+        if (ioctl(cc->fd, FICLONERANGE, &range) == 0) {
+            *cloned = 1;
+            return 0;
+        }
+        if (!offload_unsupported(errno))
+            return errno;
+        cc->flags &= ~COPY_CLONE;
+    }
+
+    if (!(cc->flags & COPY_RANGE))
+        return EXT2_ET_UNIMPLEMENTED;
+
+    while (size) {
+        n = copy_file_range(cc->fd, &off_in, cc->fd, &off_out, size, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (!offload_unsupported(errno))
+                return errno;
+            cc->flags &= ~COPY_RANGE;
+            /* 已拷贝的部分由调用者重新拷贝 */
+            return EXT2_ET_UNIMPLEMENTED;
+        }
+        if (n == 0)
+            return EXT2_ET_SHORT_READ;
+        size -= n;
+    }
+
+    /* reflink不搬数据; 内核拷贝在模拟盘上仍是一次读和一次写 */
+    size = (size_t)count * cc->blocksize;
+    sim_account((off_t)src * cc->blocksize, size, 0);
+    sim_account((off_t)dst * cc->blocksize, size, 1);
+    return 0;
+}
+
+errcode_t copy_write(struct copy_channel *cc, blk64_t blk, __u32 count, const void *buf) {
+    size_t size = (size_t)count * cc->blocksize;
+    off_t offset = (off_t)blk * cc->blocksize;
+    ssize_t n;
+
+    sim_account(offset, size, 1);
+    while (size) {
+        n = pwrite(cc->fd, buf, size, offset);
+        if (n < 0) {
+            if (errno == EINTR || direct_rejected(cc, errno))
+                continue;
+            return errno;
+        }
+        if (n == 0)
+            return EXT2_ET_SHORT_WRITE;
+        buf = (const char *)buf + n;
+        offset += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * 全0检查: compare the buffer with itself shifted by 16 bytes once the
+ * head is known to be zero, memcmp does the wide vector loads.
+ */
+int copy_is_zero(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    size_t i;
+
+    if (len < 16) {
+        for (i = 0; i < len; i++)
+            if (p[i])
+                return 0;
+        return 1;
+    }
+    for (i = 0; i < 16; i++)
+        if (p[i])
+            return 0;
+
+    return memcmp(p, p + 16, len - 16) == 0;
+}
+
+/*
+ * Zero the destination without sending the data: BLKZEROOUT on block
+ * devices, FALLOC_FL_ZERO_RANGE on image files, plain writes otherwise.
+ */
+errcode_t copy_zeroout(struct copy_channel *cc, blk64_t blk, __u32 count) {
+    __u64 range[2] = {(__u64)blk * cc->blocksize, (__u64)count * cc->blocksize};
+    struct stat st;
+    errcode_t retval;
+    char *zero;
+    __u32 i;
+
+    sim_account(range[0], range[1], 1);
+    if (fstat(cc->fd, &st) < 0)
+        return errno;
+    if (S_ISBLK(st.st_mode) && ioctl(cc->fd, BLKZEROOUT, range) == 0)
+        return 0;
+    if (S_ISREG(st.st_mode) && fallocate(cc->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, range[0], range[1]) == 0)
+        return 0;
+
+    if (retval = ext2fs_get_memalign(cc->blocksize, sysconf(_SC_PAGESIZE), &zero))
+        return retval;
+    memset(zero, 0, cc->blocksize);
+    for (i = 0; i < count && !retval; i++)
+        retval = copy_write(cc, blk + i, 1, zero);
+    ext2fs_free_mem(&zero);
+
+    return retval;
+}
+
+/* 丢弃页缓存, 下一次读取直接访问设备 */
+void copy_drop_cache(struct copy_channel *cc, blk64_t blk, __u32 count) {
+    posix_fadvise(cc->fd, (off_t)blk * cc->blocksize, (off_t)count * cc->blocksize, POSIX_FADV_DONTNEED);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static __u32 crc32c_sse42(__u32 crc, const unsigned char *p, size_t len) {
+    __u64 c = crc;
+
+    while (len && ((uintptr_t)p & 7)) {
+        c = __builtin_ia32_crc32qi((__u32)c, *p++);
+        len--;
+    }
+    for (; len >= 8; len -= 8, p += 8)
+        c = __builtin_ia32_crc32di(c, *(const __u64 *)p);
+    while (len--)
+        c = __builtin_ia32_crc32qi((__u32)c, *p++);
+
+    return (__u32)c;
+}
+#endif
+
+/*
+ * crc32c, with the SSE4.2 instruction when the cpu has it and
+ * ext2fs_crc32c_le otherwise. Both compute the same value.
+ */
+__u32 copy_crc32c(__u32 crc, const void *buf, size_t len) {
+#if defined(__x86_64__)
+    static int sse42 = -1;
+
+    if (sse42 < 0)
+        sse42 = __builtin_cpu_supports("sse4.2");
+    if (sse42)
+        return crc32c_sse42(crc, buf, len);
+#endif
+    return ext2fs_crc32c_le(crc, buf, len);
+}
+
+/*
+ * 把 [blk, blk + count) 写回设备并等待完成. The writeback is issued from the
+ * calling thread, so its I/O priority applies, and the call returns only
+ * once the device took the data, which is what a rate limit has to pace.
+ */
+errcode_t copy_flush(struct copy_channel *cc, blk64_t blk, __u32 count) {
+    if (cc->flags & COPY_DIRECT)
+        return 0;
+    if (sync_file_range(cc->fd, (off_t)blk * cc->blocksize, (off_t)count * cc->blocksize,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) < 0)
+        return errno;
+    return 0;
+}
+
+errcode_t copy_sync(struct copy_channel *cc) {
+    if (fdatasync(cc->fd) < 0)
+        return errno;
+    return 0;
+}
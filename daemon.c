@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "e2blk.h"
+
+/*
+ * 常驻分析服务
+ *
+ * Loads the bitmaps, the density pyramid, the extent index and the class map
+ * once, then answers line based queries on a Unix socket until SIGINT or
+ * SIGTERM. Block numbers may be decimal or 0x hex. Every reply ends with
+ * "OK ..." or "ERR <code> <message>":
+ *
+ *   density START END      OK <used> <blocks>
+ *   files START END [MAX]  <ino> <blocks> <flags> <path> ... OK <count>
+ *   free START END [MAX]   <start> <len> ... OK <count>
+ *   plan OFFSET            OK <move> <inodes> <pinned> <free>
+ *   stats                  OK <files> <fragmented> <extents> <free runs> <largest free>
+ *   quit
+ *
+ * Each client gets its own thread. Queries on the resident structures run
+ * in parallel, the ones going through libext2fs hold daemon_lock.
+ */
+
+#define DAEMON_LINE_MAX 256
+#define DAEMON_LIST_MAX 1000 // default MAX of files and free
+
+struct daemon_client {
+    int fd;
+    struct daemon_client *next;
+};
+
+static pthread_mutex_t daemon_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t daemon_cond = PTHREAD_COND_INITIALIZER;
+static struct daemon_client *daemon_clients = NULL;
+static volatile sig_atomic_t daemon_stop = 0;
+
+static void daemon_signal(int sig) {
+    daemon_stop = 1;
+}
+
+static int parse_args(char *args, blk64_t *v, int min, int max) {
+    char *tok, *end;
+    int n = 0;
+
+    while ((tok = strtok_r(NULL, " \t", &args)) && n < max) {
+        v[n] = strtoull(tok, &end, 0);
+        if (end == tok || *end)
+            return -1;
+        n++;
+    }
+    return n < min || tok ? -1 : n;
+}
+
+static int check_range(FILE *out, blk64_t start, blk64_t end) {
+    if (start < end && end <= ext2fs_blocks_count(fs->super))
+        return 0;
+    fprintf(out, "ERR %ld invalid range\n", (long)EXT2_ET_INVALID_ARGUMENT);
+    return 1;
+}
+
+static void query_files(FILE *out, blk64_t start, blk64_t end, __u64 max) {
+    struct index_owner *owners = NULL;
+    errcode_t retval;
+    char *name;
+    int i, n;
+
+    if (retval = extent_index_owners(fs_index, start, end, &owners, &n)) {
+        fprintf(out, "ERR %ld %s\n", retval, error_message(retval));
+        return;
+    }
+    if (n > max)
+        n = max;
+
+    pthread_mutex_lock(&daemon_lock);
+    for (i = 0; i < n; i++) {
+        if (extent_index_pathname(fs, fs_index, owners[i].ino, &name))
+            name = NULL;
+        fprintf(out, "%u %llu 0x%x %s\n", owners[i].ino, (unsigned long long)owners[i].blocks,
+                owners[i].flags, name ? name : "?");
+        ext2fs_free_mem(&name);
+    }
+    pthread_mutex_unlock(&daemon_lock);
+
+    fprintf(out, "OK %d\n", n);
+    ext2fs_free_mem(&owners);
+}
+
+static void query_free(FILE *out, blk64_t start, blk64_t end, __u64 max) {
+    blk64_t blk, s, e;
+    __u64 n = 0;
+
+    for (blk = start; blk < end && n < max; blk = e) {
+        if (ext2fs_find_first_zero_block_bitmap2(fs->block_map, blk, end - 1, &s))
+            break;
+        if (ext2fs_find_first_set_block_bitmap2(fs->block_map, s, end - 1, &e))
+            e = end;
+        fprintf(out, "%llu %llu\n", (unsigned long long)s, (unsigned long long)(e - s));
+        n++;
+    }
+    fprintf(out, "OK %llu\n", (unsigned long long)n);
+}
+
+static void query_plan(FILE *out, blk64_t offset) {
+    struct move_estimate est;
+    errcode_t retval;
+
+    pthread_mutex_lock(&daemon_lock);
+    retval = move_estimate(offset, &est);
+    pthread_mutex_unlock(&daemon_lock);
+    if (retval) {
+        fprintf(out, "ERR %ld %s\n", retval, error_message(retval));
+        return;
+    }
+    fprintf(out, "OK %llu %llu %llu %llu\n", (unsigned long long)est.blocks, (unsigned long long)est.inodes,
+            (unsigned long long)est.pinned, (unsigned long long)est.free);
+}
+
+/* 返回非0表示客户端要求断开 */
+static int handle_query(FILE *out, char *line) {
+    char *args, *cmd = strtok_r(line, " \t", &args);
+    blk64_t v[3];
+    int n;
+
+    if (!cmd)
+        return 0;
+
+    if (!strcmp(cmd, "quit"))
+        return 1;
+    if (!strcmp(cmd, "density")) {
+        if (parse_args(args, v, 2, 2) < 0)
+            goto _usage;
+        if (!check_range(out, v[0], v[1]))
+            fprintf(out, "OK %llu %llu\n", (unsigned long long)density_count(fs_density, fs->block_map, v[0], v[1]),
+                    (unsigned long long)(v[1] - v[0]));
+    } else if (!strcmp(cmd, "files") || !strcmp(cmd, "free")) {
+        if ((n = parse_args(args, v, 2, 3)) < 0)
+            goto _usage;
+        if (n == 2)
+            v[2] = DAEMON_LIST_MAX;
+        if (check_range(out, v[0], v[1]))
+            return 0;
+        if (cmd[1] == 'i')
+            query_files(out, v[0], v[1], v[2]);
+        else
+            query_free(out, v[0], v[1], v[2]);
+    } else if (!strcmp(cmd, "plan")) {
+        if (parse_args(args, v, 1, 1) < 0)
+            goto _usage;
+        query_plan(out, v[0]);
+    } else if (!strcmp(cmd, "stats")) {
+        fprintf(out, "OK %llu %llu %llu %llu %llu\n", (unsigned long long)fs_frag->files,
+                (unsigned long long)fs_frag->fragmented, (unsigned long long)fs_frag->extents,
+                (unsigned long long)fs_frag->free_runs, (unsigned long long)fs_frag->free_max);
+    } else
+        fprintf(out, "ERR %ld unknown command %s\n", (long)EXT2_ET_INVALID_ARGUMENT, cmd);
+    return 0;
+
+_usage:
+    fprintf(out, "ERR %ld bad arguments to %s\n", (long)EXT2_ET_INVALID_ARGUMENT, cmd);
+    return 0;
+}
+
+static void *daemon_client_proc(void *arg) {
+    struct daemon_client *dc = (struct daemon_client *)arg, **p;
+    char line[DAEMON_LINE_MAX];
+    FILE *in = NULL, *out = NULL;
+    int fd, quit = 0;
+    size_t len;
+
+    trace_thread_name("client");
+    in = fdopen(dc->fd, "r");
+    if (in && (fd = dup(dc->fd)) >= 0 && !(out = fdopen(fd, "w")))
+        close(fd);
+
+    while (in && out && !quit && fgets(line, sizeof(line), in)) {
+        len = strlen(line);
+        if (len && line[len - 1] != '\n' && !feof(in)) {
+            /* 行太长, 丢弃剩余部分 */
+            while (fgets(line, sizeof(line), in) && line[strlen(line) - 1] != '\n')
+                ;
+            fprintf(out, "ERR %ld line too long\n", (long)EXT2_ET_INVALID_ARGUMENT);
+        } else {
+            line[strcspn(line, "\r\n")] = 0;
+            quit = handle_query(out, line);
+        }
+        if (fflush(out))
+            break;
+    }
+
+    pthread_mutex_lock(&daemon_lock);
+    for (p = &daemon_clients; *p; p = &(*p)->next)
+        if (*p == dc) {
+            *p = dc->next;
+            break;
+        }
+    pthread_cond_broadcast(&daemon_cond);
+    pthread_mutex_unlock(&daemon_lock);
+
+    if (out)
+        fclose(out);
+    if (in)
+        fclose(in);
+    else
+        close(dc->fd);
+    ext2fs_free_mem(&dc);
+    return NULL;
+}
+
+/* 载入所有常驻结构, 查询时不再扫描 */
+static errcode_t daemon_prepare(void) {
+    errcode_t retval;
+    __u64 ts = trace_now();
+
+    if (retval = bitmaps_load(fs, move_threads, NULL))
+        return retval;
+    if (!fs_density && (retval = density_build(fs, fs->block_map, move_threads, &fs_density)))
+        return retval;
+    if (retval = fs_index_load(fs))
+        return retval;
+    if (!fs_classes && (retval = class_map_build(fs, fs_index, &fs_classes)))
+        return retval;
+    trace_span("daemon", "prepare", ts, NULL);
+    return 0;
+}
+
+errcode_t daemon_run(const char *path) {
+    struct sockaddr_un addr = {0};
+    struct daemon_client *dc;
+    struct sigaction sa = {0};
+    sigset_t stop_set, old_set, wait_set;
+    errcode_t retval;
+    pthread_t thread;
+    struct stat st;
+    mode_t mask;
+    struct pollfd pfd;
+    int sock, fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return ENAMETOOLONG;
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    printf("Loading bitmaps and indexes ... ");
+    fflush(stdout);
+    if (retval = daemon_prepare()) {
+        printf("\n");
+        return retval;
+    }
+    printf("complete\n");
+
+    /* 上次异常退出留下的socket */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (sock < 0)
+        return errno;
+    /* 路径和空闲空间布局只给属主看 */
+    mask = umask(0177);
+    retval = bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ? errno : 0;
+    umask(mask);
+    if (retval || listen(sock, 16) < 0) {
+        if (!retval)
+            retval = errno;
+        close(sock);
+        return retval;
+    }
+
+    /*
+     * 停止信号平时被屏蔽, 只在ppoll里放开: a signal that arrives between
+     * the check of daemon_stop and the wait stays pending and interrupts
+     * ppoll at once. Client threads inherit the blocked mask.
+     */
+    sa.sa_handler = daemon_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&stop_set);
+    sigaddset(&stop_set, SIGINT);
+    sigaddset(&stop_set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_set, &old_set);
+    wait_set = old_set;
+    sigdelset(&wait_set, SIGINT);
+    sigdelset(&wait_set, SIGTERM);
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    printf("Listening on %s\n", path);
+    fflush(stdout);
+    while (!daemon_stop) {
+        if (ppoll(&pfd, 1, NULL, &wait_set) < 0) {
+            if (errno == EINTR)
+                continue;
+            retval = errno;
+            break;
+        }
+        fd = accept(sock, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN)
+                continue;
+            retval = errno;
+            break;
+        }
+        if (ext2fs_get_memzero(sizeof(struct daemon_client), &dc)) {
+            close(fd);
+            continue;
+        }
+        dc->fd = fd;
+
+        pthread_mutex_lock(&daemon_lock);
+        dc->next = daemon_clients;
+        daemon_clients = dc;
+        if (pthread_create(&thread, NULL, daemon_client_proc, dc)) {
+            daemon_clients = dc->next;
+            close(fd);
+            ext2fs_free_mem(&dc);
+        } else
+            pthread_detach(thread);
+        pthread_mutex_unlock(&daemon_lock);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+    close(sock);
+    unlink(path);
+
+    /* 断开所有客户端, 等它们的线程退出后才能关闭文件系统 */
+    pthread_mutex_lock(&daemon_lock);
+    for (dc = daemon_clients; dc; dc = dc->next)
+        shutdown(dc->fd, SHUT_RDWR);
+    while (daemon_clients)
+        pthread_cond_wait(&daemon_cond, &daemon_lock);
+    pthread_mutex_unlock(&daemon_lock);
+
+    return retval;
+}
@@ -0,0 +1,203 @@
+#include "e2blk.h"
+
+/*
+ * 密度金字塔
+ *
+ * Level 0 holds the number of used blocks of every 2^shift block chunk,
+ * every level above sums 2^DENSITY_FANOUT_BITS chunks of the level below.
+ * Any range is answered from the largest aligned chunks plus two partial
+ * chunks at the edges, counted exactly when a bitmap is at hand and
+ * estimated from the chunk otherwise (a map loaded from the scan cache).
+ */
+
+#define DENSITY_MAX_CHUNKS (1ULL << 22)
+#define DENSITY_MIN_SHIFT 6
+
+struct density_map *fs_density = NULL;
+
+/* 统计位图 [start, start + n) 中置位的个数 */
+__u64 bitmap_popcount(ext2fs_block_bitmap bmap, blk64_t start, __u64 n) {
+    __u64 buf[64], total = 0, word;
+    blk64_t first = ext2fs_get_block_bitmap_start2(bmap); // 不依赖全局fs, 可用于多个文件系统
+    size_t bits, i;
+
+    if (start < first) {
+        if (start + n <= first)
+            return 0;
+        n -= first - start;
+        start = first;
+    }
+    if (fs_runs && fs_runs->bmap == bmap)
+        return run_map_count(fs_runs, start, start + n);
+
+    while (n) {
+        bits = n > sizeof(buf) * 8 ? sizeof(buf) * 8 : n;
+        memset(buf, 0, sizeof(buf));
+        if (ext2fs_get_block_bitmap_range2(bmap, start, bits, buf))
+            break;
+        for (i = 0; i < bits / 64; i++)
+            total += __builtin_popcountll(buf[i]);
+        if (bits % 64) {
+            word = buf[i] & ((1ULL << (bits % 64)) - 1);
+            total += __builtin_popcountll(word);
+        }
+        start += bits;
+        n -= bits;
+    }
+
+    return total;
+}
+
+errcode_t density_alloc(blk64_t blocks, unsigned int shift, struct density_map **ret) {
+    struct density_map *dm;
+    errcode_t retval;
+    __u64 chunks;
+    int l;
+
+    if (retval = ext2fs_get_memzero(sizeof(struct density_map), &dm))
+        return retval;
+
+    dm->blocks = blocks;
+    dm->shift = shift;
+    chunks = (blocks + (1ULL << shift) - 1) >> shift;
+    for (l = 0; l < DENSITY_MAX_LEVELS; l++) {
+        /* 每块计数必须放得进__u32 */
+        if (l && (chunks <= 1 || shift + l * DENSITY_FANOUT_BITS >= 32))
+            break;
+        dm->count[l] = chunks;
+        if (retval = ext2fs_get_arrayzero(chunks, sizeof(__u32), &dm->level[l])) {
+            density_free(dm);
+            return retval;
+        }
+        dm->levels = l + 1;
+        chunks = (chunks + (1 << DENSITY_FANOUT_BITS) - 1) >> DENSITY_FANOUT_BITS;
+    }
+
+    *ret = dm;
+    return 0;
+}
+
+/* 由第0层汇总上层 */
+void density_sum_levels(struct density_map *dm) {
+    __u64 i;
+    int l;
+
+    for (l = 1; l < dm->levels; l++) {
+        memset(dm->level[l], 0, dm->count[l] * sizeof(__u32));
+        for (i = 0; i < dm->count[l - 1]; i++)
+            dm->level[l][i >> DENSITY_FANOUT_BITS] += dm->level[l - 1][i];
+    }
+}
+
+struct density_build_context {
+    struct density_map *dm;
+    ext2fs_block_bitmap bmap;
+    __u64 first; // chunk range of this thread
+    __u64 last;
+};
+
+static void *density_build_proc(void *arg) {
+    struct density_build_context *ctx = (struct density_build_context *)arg;
+    struct density_map *dm = ctx->dm;
+    __u64 i, n;
+
+    for (i = ctx->first; i < ctx->last; i++) {
+        n = 1ULL << dm->shift;
+        if ((i << dm->shift) + n > dm->blocks)
+            n = dm->blocks - (i << dm->shift);
+        dm->level[0][i] = bitmap_popcount(ctx->bmap, i << dm->shift, n);
+    }
+    return NULL;
+}
+
+/*
+ * 第0层按块区间分给 `nthreads` 个线程. get_range on the bitarray and
+ * rbtree backends only reads the bitmap, so concurrent callers are safe.
+ */
+errcode_t density_build(ext2_filsys fs, ext2fs_block_bitmap bmap, int nthreads, struct density_map **ret) {
+    blk64_t blocks = ext2fs_blocks_count(fs->super);
+    struct density_build_context *ctx = NULL;
+    struct density_map *dm;
+    unsigned int shift = DENSITY_MIN_SHIFT;
+    errcode_t retval;
+    int i;
+
+    while ((blocks >> shift) > DENSITY_MAX_CHUNKS)
+        shift++;
+
+    if (retval = density_alloc(blocks, shift, &dm))
+        return retval;
+
+    if (nthreads < 1)
+        nthreads = 1;
+    if ((__u64)nthreads > dm->count[0])
+        nthreads = dm->count[0];
+    if (retval = ext2fs_get_arrayzero(nthreads, sizeof(struct density_build_context), &ctx)) {
+        density_free(dm);
+        return retval;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        ctx[i].dm = dm;
+        ctx[i].bmap = bmap;
+        ctx[i].first = dm->count[0] * i / nthreads;
+        ctx[i].last = dm->count[0] * (i + 1) / nthreads;
+    }
+    run_parallel(nthreads, density_build_proc, ctx, sizeof(struct density_build_context));
+
+    density_sum_levels(dm);
+    *ret = dm;
+    ext2fs_free_mem(&ctx);
+    return 0;
+}
+
+void density_free(struct density_map *dm) {
+    int l;
+
+    if (!dm)
+        return;
+    if (!dm->mapped)
+        for (l = 0; l < dm->levels; l++)
+            ext2fs_free_mem(&dm->level[l]);
+    ext2fs_free_mem(&dm);
+}
+
+/*
+ * 已用块数 in [start, end). `bmap` may be NULL, the partial chunks at the
+ * edges are then estimated.
+ */
+__u64 density_count(struct density_map *dm, ext2fs_block_bitmap bmap, blk64_t start, blk64_t end) {
+    __u64 total = 0, size, idx, clen;
+    blk64_t cend;
+    int l;
+
+    if (end > dm->blocks)
+        end = dm->blocks;
+
+    while (start < end) {
+        for (l = dm->levels - 1; l >= 0; l--) {
+            size = 1ULL << (dm->shift + l * DENSITY_FANOUT_BITS);
+            if (start % size == 0 && start + size <= end)
+                break;
+        }
+        if (l >= 0) {
+            total += dm->level[l][start / size];
+            start += size;
+            continue;
+        }
+
+        /* 边缘的部分块 */
+        idx = start >> dm->shift;
+        cend = (idx + 1) << dm->shift;
+        clen = cend > dm->blocks ? dm->blocks - (idx << dm->shift) : 1ULL << dm->shift;
+        if (cend > end)
+            cend = end;
+        if (bmap)
+            total += bitmap_popcount(bmap, start, cend - start);
+        else
+            total += (__u64)dm->level[0][idx] * (cend - start) / clen;
+        start = cend;
+    }
+
+    return total;
+}
@@ -1,4 +1,6 @@
 
+#include <sys/stat.h>
+
 #include "e2blk.h"
 
 extern int init_ncurses();
@@ -8,10 +10,20 @@ ext2_filsys fs;
 unsigned int block_size;
 unsigned long long device_size;
 char *device_name;
+int use_mmap = 0;
+char *cache_path = NULL;
+
+/* 位图读取进度, 在同一行刷新 */
+static void bitmap_progress(__u64 done, __u64 total) {
+    printf("\rReading inode and block bitmaps ... %llu%%", total ? (unsigned long long)(done * 100 / total) : 100ULL);
+    fflush(stdout);
+}
 
 static int open_filesystem(int open_flags, blk64_t superblock, blk64_t blocksize) {
     int retval;
     io_manager io_ptr = unix_io_manager;
+    struct stat st;
+    __u64 ts;
 
     if (superblock != 0 && blocksize == 0) {
         com_err(device_name, 0, "if you specify the superblock, you must also specify the block size");
@@ -19,23 +31,75 @@ static int open_filesystem(int open_flags, blk64_t superblock, blk64_t blocksize
         return EX_USAGE;
     }
 
+    /* 镜像文件可以直接映射到内存 */
+    if (use_mmap) {
+        if (stat(device_name, &st) == 0 && S_ISREG(st.st_mode)
+            && !(open_flags & (EXT2_FLAG_DIRECT_IO | EXT2_FLAG_IMAGE_FILE)))
+            io_ptr = mmap_io_manager;
+        else
+            fprintf(stderr, "%s: mmap I/O needs a plain image file, using unix I/O\n", device_name);
+    }
+
+    /* 叠加在实际的io_manager之上 */
+    if (sim_enabled) {
+        sim_io_backing = io_ptr;
+        io_ptr = sim_io_manager;
+    }
+
     retval = ext2fs_open(device_name, open_flags, superblock, blocksize, io_ptr, &fs);
     if (retval) {
         com_err(prog_name, retval, "while trying to open %s", device_name);
         fs = NULL;
         return EX_DEVICE;
     }
-    fs->default_bitmap_type = EXT2FS_BMAP64_RBTREE;
+    if (sim_enabled)
+        sim_set_capacity(ext2fs_blocks_count(fs->super) * EXT2_BLOCK_SIZE(fs->super));
+
+    /* 按段数选择位图的表示, 必须在读取位图之前 */
+    if (retval = bitmap_choose(fs, bitmap_mode, &fs_bitmap_choice)) {
+        com_err(device_name, retval, "while sampling the block bitmaps");
+        goto errout;
+    }
+
+    /* 文件系统未变化时直接使用扫描缓存, 位图推迟到第一次需要时读取 */
+    if (cache_path) {
+        ts = trace_now();
+        retval = cache_load(fs, cache_path);
+        trace_span("scan", "cache_load", ts, "\"error\":%d", retval);
+        if (retval == 0 && fs_density) {
+            printf("Loaded scan cache %s\n", cache_path);
+            return 0;
+        }
+        if (retval == ESTALE)
+            printf("Scan cache %s is stale, rescanning\n", cache_path);
+        else if (retval && retval != ENOENT)
+            com_err(cache_path, retval, "while loading scan cache");
+    }
 
     printf("Reading inode and block bitmaps ... ");
+    fflush(stdout);
 
-    retval = ext2fs_read_bitmaps(fs);
+    ts = trace_now();
+    retval = bitmaps_load(fs, move_threads, bitmap_progress);
+    trace_span("scan", "read_bitmaps", ts, "\"groups\":%u", fs->group_desc_count);
     if (retval) {
         printf("\n");
         com_err(device_name, retval, "while reading allocation bitmaps");
         goto errout;
     }
-    printf("complete\n");
+    printf("\rReading inode and block bitmaps ... complete        \n");
+    printf("%s\n", bitmap_summary);
+    bitmap_summary[0] = 0;
+
+    if (cache_path && !fs_density) {
+        ts = trace_now();
+        retval = density_build(fs, fs->block_map, move_threads, &fs_density);
+        trace_span("scan", "density_build", ts, NULL);
+        if (retval) {
+            com_err(device_name, retval, "while counting used blocks");
+            goto errout;
+        }
+    }
 
     return 0;
 
@@ -49,7 +113,14 @@ errout:
 }
 
 static void close_filesystem() {
-    int retval, err;
+    int retval, err = 0;
+    __u64 ts = trace_now();
+
+    if (cache_path && (retval = cache_save(fs, cache_path)))
+        com_err(cache_path, retval, "while saving scan cache");
+    trace_span("scan", "cache_save", ts, NULL);
+    cache_close();
+    buf_pool_free();
 
     if (fs->flags & EXT2_FLAG_IB_DIRTY) {
         retval = ext2fs_write_inode_bitmap(fs);
@@ -141,13 +212,20 @@ static int need_check(int force) {
 }
 
 int main(int argc, char **argv) {
-    const char *usage = "Usage: %s [-b blocksize] [-s superblock] [-D] [-V] device\n";
+    const char *usage = "Usage: %s [-b blocksize] [-s superblock] [-j threads] [-c] [-z] [-d] [-F] [-m] [-L] [-r MB/s] [-I iops] [-P ioprio] [-C cachefile] [-T tracefile] [-E image [-G WxH]] [-S socket] [-k] [-M memlimit [-t scratchdir]] [-H diskmodel] [-A bitmap] [-D] [-V] device\n"
+                        "       %s -B list [-O offset] [-o report] [-j threads]\n";
     int c;
-    const char *opt_string = "iDVfb:s:";
+    const char *opt_string = "iDVfkczdFmLb:s:j:C:r:I:P:T:E:G:S:M:t:H:B:O:o:A:";
     int open_flags = EXT2_FLAG_SOFTSUPP_FEATURES | EXT2_FLAG_64BITS | EXT2_FLAG_THREADS | EXT2_FLAG_RW;
     blk64_t superblock = 0;
+    const char *trace_path = NULL;
+    const char *export_path = NULL;
+    const char *socket_path = NULL;
+    const char *fleet_list = NULL;
+    const char *report_path = NULL;
     int offset_size = 0;
     int force = 0;
+    int check_only = 0;
     errcode_t ret;
 
     while ((c = getopt(argc, argv, opt_string)) != EOF) {
@@ -161,30 +239,151 @@ int main(int argc, char **argv) {
         case 'f':
             force = 1;
             break;
+        case 'k':
+            check_only = 1;
+            break;
+        case 'c':
+            move_verify = 1;
+            break;
+        case 'z':
+            move_zero = 1;
+            break;
+        case 'd':
+            move_discard = 1;
+            break;
+        case 'F':
+            move_locality = 0;
+            break;
+        case 'L':
+            buf_pool_hugepages = 1;
+            break;
+        case 'm':
+            use_mmap = 1;
+            break;
+        case 'r':
+            rate_mbps = parse_unsigned(optarg, 4, argv[0], "Invalid rate (MB/s):", NULL);
+            break;
+        case 'I':
+            rate_iops = parse_unsigned(optarg, 4, argv[0], "Invalid IOPS limit:", NULL);
+            break;
+        case 'P':
+            io_priority = parse_ioprio(optarg);
+            if (io_priority < 0) {
+                com_err(argv[0], 0, "ioprio must be idle, be[:0-7] or rt[:0-7]");
+                exit(EX_USAGE);
+            }
+            break;
+        case 'M':
+            /* 内存上限按字节计, 不接受块数 */
+            mem_limit = -parse_unsigned(optarg, -1, argv[0], "Invalid memory limit:", NULL);
+            if ((long long)mem_limit < 0) {
+                com_err(argv[0], 0, "memory limit must be given in bytes, K, M or G");
+                exit(EX_USAGE);
+            }
+            break;
+        case 't':
+            spill_dir = optarg;
+            break;
+        case 'H':
+            if (sim_parse(optarg)) {
+                com_err(argv[0], 0, "disk model must be hdd or rpm=N,seek=MIN:MAX,bw=SIZE,disks=N,stripe=SIZE,delay");
+                exit(EX_USAGE);
+            }
+            break;
+        case 'A':
+            for (bitmap_mode = BMAP_RUNS; bitmap_mode > BMAP_AUTO; bitmap_mode--)
+                if (!strcmp(optarg, bitmap_type_name[bitmap_mode]) || (bitmap_mode == BMAP_RUNS && !strcmp(optarg, "runs")))
+                    break;
+            if (bitmap_mode == BMAP_AUTO && strcmp(optarg, "auto")) {
+                com_err(argv[0], 0, "bitmap must be auto, bitarray, rbtree or runs");
+                exit(EX_USAGE);
+            }
+            break;
+        case 'B':
+            fleet_list = optarg;
+            break;
+        case 'O':
+            /* 各设备块大小不同, 只接受字节数 */
+            fleet_offset = -parse_unsigned(optarg, -1, argv[0], "Invalid offset:", NULL);
+            if ((long long)fleet_offset < 0) {
+                com_err(argv[0], 0, "offset must be given in bytes, K, M or G");
+                exit(EX_USAGE);
+            }
+            break;
+        case 'o':
+            report_path = optarg;
+            break;
+        case 'C':
+            cache_path = optarg;
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'E':
+            export_path = optarg;
+            break;
+        case 'S':
+            socket_path = optarg;
+            /* 只读打开, 服务期间不修改文件系统 */
+            open_flags &= ~EXT2_FLAG_RW;
+            break;
+        case 'G':
+            if (sscanf(optarg, "%ux%u", &export_width, &export_height) != 2 || !export_width || !export_height) {
+                com_err(argv[0], 0, "Invalid image size: %s", optarg);
+                exit(EX_USAGE);
+            }
+            break;
         case 'b':
             block_size = parse_unsigned(optarg, 4, argv[0], "Invalid block size:", NULL);
             break;
         case 's':
             superblock = parse_unsigned(optarg, 8, argv[0], "Invalid superblock block number:", NULL);
             break;
+        case 'j':
+            move_threads = parse_unsigned(optarg, 4, argv[0], "Invalid thread count:", NULL);
+            if (move_threads < 1 || move_threads > 256) {
+                com_err(argv[0], 0, "thread count must be between 1 and 256");
+                exit(EX_USAGE);
+            }
+            break;
         case 'V':
             /* Print version number and exit */
             fprintf(stderr, "\tUsing %s\n", error_message(EXT2_ET_BASE));
             exit(EX_OK);
         default:
-            com_err(argv[0], 0, usage, prog_name);
+            com_err(argv[0], 0, usage, prog_name, prog_name);
             return 1;
         }
     }
 
+    /* 批量模式不打开单个设备 */
+    if (fleet_list) {
+        if (trace_path && (ret = trace_open(trace_path))) {
+            com_err(trace_path, ret, "while opening trace file");
+            exit(EX_USAGE);
+        }
+        if (ret = fleet_run(fleet_list, report_path, move_threads)) {
+            com_err(prog_name, ret, "while running batch analysis of %s", fleet_list);
+            ret = EX_IOERR;
+        }
+        trace_close();
+        exit(ret);
+    }
+
     if (optind == argc) {
         fprintf(stderr, "Please specify the file system to be opened.\n");
-        com_err(argv[0], 0, usage, prog_name);
+        com_err(argv[0], 0, usage, prog_name, prog_name);
         exit(EX_USAGE);
     }
     device_name = argv[optind];
 
+    if (trace_path && (ret = trace_open(trace_path))) {
+        com_err(trace_path, ret, "while opening trace file");
+        exit(EX_USAGE);
+    }
+
     if (ret = open_filesystem(open_flags, superblock, block_size)) {
+        trace_close();
         exit(ret);
     }
     block_size = EXT2_BLOCK_SIZE(fs->super);
@@ -194,6 +393,41 @@ int main(int argc, char **argv) {
         goto _close;
     }
 
+    if (check_only) {
+        struct precheck_result pc;
+        char msg[256];
+
+        printf("Checking filesystem consistency ... ");
+        fflush(stdout);
+        if (ret = precheck_run(fs, move_threads, &pc)) {
+            printf("\n");
+            com_err(device_name, ret, "while checking the filesystem");
+            ret = EX_OSERR;
+            goto _close;
+        }
+        precheck_summary(&pc, msg, sizeof(msg));
+        printf("\n%s\n", msg);
+        ret = precheck_failed(&pc) ? EX_DATAERR : 0;
+        goto _close;
+    }
+
+    /* 无界面导出 */
+    if (export_path) {
+        if (ret = export_image(export_path, export_width, export_height)) {
+            com_err(export_path, ret, "while exporting the block map");
+            ret = EX_IOERR;
+        }
+        goto _close;
+    }
+
+    if (socket_path) {
+        if (ret = daemon_run(socket_path)) {
+            com_err(socket_path, ret, "while serving queries");
+            ret = EX_OSERR;
+        }
+        goto _close;
+    }
+
     if (ret = init_ncurses())
         goto _close;
     
@@ -201,6 +435,16 @@ _close:
 
     if (fs)
         close_filesystem();
+    trace_close();
+    /* 使用扫描缓存时位图在会话中才读入, 报告留到最后 */
+    if (bitmap_summary[0])
+        printf("%s\n", bitmap_summary);
+    if (sim_enabled) {
+        char msg[256];
+
+        sim_summary(msg, sizeof(msg));
+        fprintf(stderr, "%s\n", msg);
+    }
 
     exit(ret);
 }
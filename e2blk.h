@@ -38,6 +38,10 @@ enum {
     CP_EMP,
     CP_DAT,
     CP_HL,
+    CP_OVL,
+    CP_JNL,
+    CP_DIR,
+    CP_META,
 };
 
 
@@ -50,6 +54,313 @@ extern char *device_name;
 
 extern int unicode;
 
+/* index.c */
+#define EREC_META 0x01   // extent tree node, indirect or xattr block
+#define EREC_UNINIT 0x02 // unwritten extent
+#define EREC_DIR 0x04    // owned by a directory
+#define EREC_RSV 0x08    // owned by a reserved inode (journal, resize ...)
+#define EREC_EXTENT 0x10 // mapped through an extent tree
+
+struct extent_rec {
+    blk64_t pblk;
+    blk64_t lblk;
+    __u32 len;
+    ext2_ino_t ino;
+    __u16 flags;
+};
+
+struct extent_index {
+    struct extent_rec *recs; // sorted by pblk
+    __u64 count;
+    __u64 size;
+    __u32 max_len;
+    ext2_ino_t inodes;
+    ext2_ino_t *parent; // parent directory of each inode, built on demand
+    int mapped;         // recs point into the scan cache
+};
+
+struct index_owner {
+    ext2_ino_t ino;
+    __u16 flags;
+    __u64 blocks;
+};
+
+struct frag_stats {
+    __u64 files;       // inodes owning data blocks
+    __u64 fragmented;  // files with more than one extent
+    __u64 extents;     // data extents of all files
+    __u64 max_extents; // extents of the most fragmented file
+    ext2_ino_t max_ino;
+    __u32 pad;
+    __u64 free_runs;   // free extents
+    __u64 free_max;    // largest free extent, in blocks
+};
+
+extern struct extent_index *fs_index;
+extern struct frag_stats *fs_frag;
+
+errcode_t inode_walk_runs(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
+                          int (*func)(const struct extent_rec *rec, void *priv), void *priv);
+errcode_t extent_index_build(ext2_filsys fs, struct extent_index **ret);
+void extent_index_free(struct extent_index *idx);
+__u64 extent_index_find(struct extent_index *idx, blk64_t blk);
+errcode_t extent_index_owners(struct extent_index *idx, blk64_t start, blk64_t end,
+                              struct index_owner **ret, int *count);
+errcode_t extent_index_parents(ext2_filsys fs, struct extent_index *idx);
+errcode_t extent_index_pathname(ext2_filsys fs, struct extent_index *idx, ext2_ino_t ino, char **name);
+errcode_t frag_stats_compute(ext2_filsys fs, struct extent_index *idx, struct frag_stats **ret);
+errcode_t fs_index_load(ext2_filsys fs);
+
+/* bmap.c */
+enum {
+    BMAP_AUTO = 0,
+    BMAP_BITARRAY,
+    BMAP_RBTREE,
+    BMAP_RUNS, // rbtree, range counts from a run map
+};
+
+struct bitmap_choice {
+    ext2_filsys fs;           // filesystem the choice was made for
+    int type;                 // BMAP_*
+    __u64 runs;               // estimated used runs
+    __u64 mem[BMAP_RUNS + 1]; // estimated bytes of each representation
+};
+
+struct run_map {
+    ext2fs_block_bitmap bmap; // counts are only valid for this bitmap
+    struct used_run *runs;    // sorted by start
+    __u64 count;
+};
+
+extern int bitmap_mode;
+extern struct run_map *fs_runs;
+extern struct bitmap_choice fs_bitmap_choice;
+extern char bitmap_summary[256];
+extern const char *bitmap_type_name[BMAP_RUNS + 1];
+
+errcode_t bitmap_choose(ext2_filsys fs, int mode, struct bitmap_choice *ch);
+errcode_t run_map_build(ext2_filsys fs, ext2fs_block_bitmap bmap, struct run_map **ret);
+void run_map_free(struct run_map *rm);
+__u64 run_map_count(struct run_map *rm, blk64_t start, blk64_t end);
+void bitmap_report(ext2_filsys fs, struct bitmap_choice *ch, char *buf, size_t size);
+void bitmap_prepare(ext2_filsys fs, int loaded);
+
+/* bitmaps.c */
+errcode_t bitmaps_load(ext2_filsys fs, int nthreads, void (*progress)(__u64 done, __u64 total));
+
+/* density.c */
+#define DENSITY_MAX_LEVELS 8
+#define DENSITY_FANOUT_BITS 4 // 16 chunks per chunk of the level above
+
+struct density_map {
+    blk64_t blocks;
+    unsigned int shift; // level 0 chunk is 2^shift blocks
+    int levels;
+    int mapped;         // levels point into the scan cache
+    __u64 count[DENSITY_MAX_LEVELS];
+    __u32 *level[DENSITY_MAX_LEVELS];
+};
+
+extern struct density_map *fs_density;
+
+__u64 bitmap_popcount(ext2fs_block_bitmap bmap, blk64_t start, __u64 n);
+errcode_t density_alloc(blk64_t blocks, unsigned int shift, struct density_map **ret);
+void density_sum_levels(struct density_map *dm);
+errcode_t density_build(ext2_filsys fs, ext2fs_block_bitmap bmap, int nthreads, struct density_map **ret);
+void density_free(struct density_map *dm);
+__u64 density_count(struct density_map *dm, ext2fs_block_bitmap bmap, blk64_t start, blk64_t end);
+
+/* classmap.c */
+enum {
+    BCLASS_FREE = 0,
+    BCLASS_SUPER,    // superblock, group descriptors, reserved GDT
+    BCLASS_BITMAP,   // block and inode bitmaps
+    BCLASS_ITABLE,   // inode tables
+    BCLASS_JOURNAL,  // journal
+    BCLASS_DIR,      // directory blocks
+    BCLASS_DATA,     // file data
+    BCLASS_META,     // extent tree nodes, indirect and xattr blocks
+    BCLASS_RESERVED, // other reserved inodes, never moved
+    BCLASS_MAX,
+};
+
+struct class_run {
+    blk64_t start;
+    __u32 len;
+    __u8 cls;
+};
+
+struct class_map {
+    struct class_run *runs; // sorted, not overlapping
+    __u64 count;
+    __u64 size;
+};
+
+extern struct class_map *fs_classes;
+extern const char *block_class_name[BCLASS_MAX];
+
+errcode_t class_map_build(ext2_filsys fs, struct extent_index *idx, struct class_map **ret);
+void class_map_free(struct class_map *cm);
+int class_map_get(struct class_map *cm, blk64_t blk);
+void class_map_count(struct class_map *cm, blk64_t start, blk64_t end, __u64 counts[BCLASS_MAX]);
+int class_map_dominant(__u64 counts[BCLASS_MAX], __u64 used);
+
+/* export.c */
+extern unsigned int export_width;
+extern unsigned int export_height;
+
+errcode_t export_image(const char *path, unsigned int width, unsigned int height);
+
+/* cache.c */
+errcode_t cache_load(ext2_filsys fs, const char *path);
+errcode_t cache_save(ext2_filsys fs, const char *path);
+void cache_invalidate(void);
+void cache_close(void);
+
+/* spill.c */
+struct spill_runs {
+    int *fds;       // one scratch file per sorted run
+    __u64 *counts;  // records in each run
+    int nruns, size;
+    size_t rec_size;
+    __u64 total;
+};
+
+extern unsigned long long mem_limit;
+extern const char *spill_dir;
+
+errcode_t spill_resize_array(unsigned long size, unsigned long long old_count,
+                             unsigned long long count, void *ptr);
+errcode_t spill_get_arrayzero(unsigned long size, unsigned long long count, void *ptr);
+void spill_free(void *ptr);
+__u64 spill_run_bytes(void);
+errcode_t spill_write_run(struct spill_runs *sr, const void *recs, __u64 count);
+errcode_t spill_merge_runs(struct spill_runs *sr, int (*cmp)(const void *, const void *), void **ret);
+void spill_runs_free(struct spill_runs *sr);
+
+/* mmap_io.c */
+extern io_manager mmap_io_manager;
+
+/* simio.c */
+extern int sim_enabled;
+extern io_manager sim_io_backing;
+extern io_manager sim_io_manager;
+
+errcode_t sim_parse(const char *spec);
+void sim_set_capacity(__u64 bytes);
+void sim_account(__u64 offset, __u64 size, int write);
+void sim_summary(char *buf, size_t size);
+
+/* bufpool.c */
+extern int buf_pool_hugepages;
+
+errcode_t buf_pool_init(int count, size_t size);
+char *buf_pool_get(void);
+void buf_pool_put(char *buf);
+void buf_pool_free(void);
+
+/* move.c */
+extern int move_threads;
+extern int move_verify;
+extern int move_zero;
+extern int move_discard;
+extern int move_locality;
+
+struct move_estimate {
+    __u64 blocks; // used blocks that would be moved
+    __u64 inodes; // inodes that would be rewritten
+    __u64 pinned; // used blocks that can not be moved
+    __u64 free;   // free blocks at or above the offset
+};
+
+errcode_t move_estimate_fs(ext2_filsys fs, struct extent_index *idx, struct density_map *dm,
+                           struct class_map *cm, blk64_t offset, struct move_estimate *est);
+errcode_t move_estimate(blk64_t offset, struct move_estimate *est);
+
+/* precheck.c */
+struct precheck_result {
+    __u64 bad_free_blocks;  // groups whose free block count differs from the bitmap
+    __u64 bad_free_inodes;  // groups whose free inode count differs from the bitmap
+    __u64 bad_csum;         // descriptor and bitmap checksum mismatches
+    __u64 out_of_bounds;    // index runs outside the filesystem
+    __u64 unmarked;         // owned blocks free in the bitmap
+    __u64 multiply_claimed; // blocks owned by more than one inode
+    __u64 shared;           // xattr blocks shared by several inodes, allowed
+    dgrp_t bad_group;
+    int bad_group_found;
+    ext2_ino_t bad_ino;     // lowest inode with a problem, 0 if none
+};
+
+errcode_t precheck_run(ext2_filsys fs, int nthreads, struct precheck_result *res);
+int precheck_failed(struct precheck_result *res);
+void precheck_summary(struct precheck_result *res, char *buf, size_t size);
+
+/* fleet.c */
+extern unsigned long long fleet_offset;
+
+errcode_t fleet_run(const char *list, const char *report, int nthreads);
+
+/* daemon.c */
+errcode_t daemon_run(const char *path);
+
+/* ratelimit.c */
+struct rate_limit {
+    pthread_mutex_t lock;
+    __u64 bytes_rate; // bytes per second, 0 is unlimited
+    __u64 iops_rate;  // requests per second, 0 is unlimited
+    double bytes;     // tokens, negative is debt
+    double ios;
+    double last;      // time of the last refill
+};
+
+extern unsigned int rate_mbps;
+extern unsigned int rate_iops;
+extern int io_priority;
+
+void rate_limit_init(struct rate_limit *rl, __u64 bytes_rate, __u64 iops_rate);
+void rate_limit_destroy(struct rate_limit *rl);
+void rate_limit_set(struct rate_limit *rl, __u64 bytes_rate, __u64 iops_rate);
+void rate_limit_get(struct rate_limit *rl, __u64 *bytes_rate, __u64 *iops_rate);
+void rate_limit_wait(struct rate_limit *rl, __u64 bytes, __u32 ios);
+int parse_ioprio(const char *str);
+errcode_t set_thread_ioprio(int ioprio);
+
+/* parallel.c */
+void run_parallel(int nthreads, void *(*proc)(void *), void *ctx, size_t ctx_size);
+
+/* trace.c */
+extern FILE *trace_file;
+
+errcode_t trace_open(const char *path);
+void trace_close(void);
+__u64 trace_now(void);
+void trace_thread_name(const char *name);
+void trace_span(const char *cat, const char *name, __u64 start, const char *fmt, ...);
+
+/* copy.c */
+#define COPY_CLONE 0x01 // FICLONERANGE may work
+#define COPY_RANGE 0x02 // copy_file_range may work
+#define COPY_DIRECT 0x04 // O_DIRECT, buffers must be aligned
+
+struct copy_channel {
+    int fd;
+    unsigned int blocksize;
+    int flags;
+    unsigned int clone_align; // host filesystem block size
+};
+
+errcode_t copy_open(const char *name, unsigned int blocksize, int flags, struct copy_channel **ret);
+void copy_close(struct copy_channel *cc);
+errcode_t copy_read(struct copy_channel *cc, blk64_t blk, __u32 count, void *buf);
+errcode_t copy_write(struct copy_channel *cc, blk64_t blk, __u32 count, const void *buf);
+errcode_t copy_offload(struct copy_channel *cc, blk64_t src, blk64_t dst, __u32 count, int *cloned);
+errcode_t copy_sync(struct copy_channel *cc);
+errcode_t copy_flush(struct copy_channel *cc, blk64_t blk, __u32 count);
+errcode_t copy_zeroout(struct copy_channel *cc, blk64_t blk, __u32 count);
+int copy_is_zero(const void *buf, size_t len);
+void copy_drop_cache(struct copy_channel *cc, blk64_t blk, __u32 count);
+__u32 copy_crc32c(__u32 crc, const void *buf, size_t len);
+
 unsigned long long parse_unsigned(const char *str, int size, const char *cmd, const char *descr, int *err);
 int win_clear(WINDOW *win, int y, int x, int length);
 int readline(const char *promt, char *line, int len);
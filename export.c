@@ -0,0 +1,308 @@
+#include <strings.h>
+
+#include "e2blk.h"
+
+/*
+ * 离线导出高分辨率图像
+ *
+ * Every pixel is a slice of the block range, in raster order like the
+ * preview cells, shaded from white (free) to the colour of its dominant
+ * block class by how full it is. Rows are rendered in bands by
+ * `move_threads` threads through density_count(), then streamed to a binary
+ * PPM or to a PNG made of stored (uncompressed) deflate blocks, so no zlib
+ * is needed and memory stays at one band.
+ */
+
+#define EXPORT_BAND_ROWS 256
+#define DEFLATE_STORED_MAX 65535
+
+unsigned int export_width = 4096;
+unsigned int export_height = 4096;
+
+static const unsigned char class_rgb[BCLASS_MAX][3] = {
+    [BCLASS_FREE] = {255, 255, 255},
+    [BCLASS_SUPER] = {200, 30, 30},
+    [BCLASS_BITMAP] = {200, 30, 30},
+    [BCLASS_ITABLE] = {200, 30, 30},
+    [BCLASS_JOURNAL] = {220, 170, 0},
+    [BCLASS_DIR] = {20, 150, 40},
+    [BCLASS_META] = {0, 160, 170},
+    [BCLASS_RESERVED] = {200, 30, 30},
+    [BCLASS_DATA] = {30, 60, 200},
+};
+
+struct image_writer {
+    FILE *f;
+    int png;
+    __u32 width;
+    __u32 adler_a, adler_b;
+    __u32 crc_table[256];
+    unsigned char *block; // pending deflate payload
+    size_t len;
+    int started;          // zlib header written
+};
+
+static void put_be32(unsigned char *p, __u32 v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/* PNG用的是IEEE crc32, 不是crc32c */
+static void crc32_init(__u32 *table) {
+    __u32 c, n, k;
+
+    for (n = 0; n < 256; n++) {
+        for (c = n, k = 0; k < 8; k++)
+            c = c & 1 ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+        table[n] = c;
+    }
+}
+
+static __u32 crc32_update(__u32 *table, __u32 crc, const unsigned char *p, size_t len) {
+    while (len--)
+        crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+static errcode_t png_chunk(struct image_writer *iw, const char *type, const unsigned char *data, size_t len) {
+    unsigned char hdr[8], crc[4];
+    __u32 c;
+
+    put_be32(hdr, len);
+    memcpy(hdr + 4, type, 4);
+    c = crc32_update(iw->crc_table, ~0U, hdr + 4, 4);
+    c = crc32_update(iw->crc_table, c, data, len);
+    put_be32(crc, ~c);
+
+    if (fwrite(hdr, 8, 1, iw->f) != 1 || (len && fwrite(data, len, 1, iw->f) != 1) || fwrite(crc, 4, 1, iw->f) != 1)
+        return errno ? errno : EXT2_ET_SHORT_WRITE;
+    return 0;
+}
+
+/* 一个stored deflate块作为一个IDAT */
+static errcode_t png_flush_block(struct image_writer *iw, int final) {
+    unsigned char *buf, *p;
+    errcode_t retval;
+
+    if (retval = ext2fs_get_mem(iw->len + 2 + 5 + 4, &buf))
+        return retval;
+    p = buf;
+    if (!iw->started) {
+        *p++ = 0x78; // deflate, 32K window
+        *p++ = 0x01;
+        iw->started = 1;
+    }
+    *p++ = final ? 1 : 0;
+    *p++ = iw->len & 0xFF;
+    *p++ = iw->len >> 8;
+    *p++ = ~iw->len & 0xFF;
+    *p++ = (~iw->len >> 8) & 0xFF;
+    memcpy(p, iw->block, iw->len);
+    p += iw->len;
+    if (final) {
+        put_be32(p, (iw->adler_b << 16) | iw->adler_a);
+        p += 4;
+    }
+
+    retval = png_chunk(iw, "IDAT", buf, p - buf);
+    ext2fs_free_mem(&buf);
+    iw->len = 0;
+    return retval;
+}
+
+static errcode_t png_write(struct image_writer *iw, const unsigned char *data, size_t len) {
+    errcode_t retval;
+    size_t n, i;
+
+    while (len) {
+        n = DEFLATE_STORED_MAX - iw->len < len ? DEFLATE_STORED_MAX - iw->len : len;
+        memcpy(iw->block + iw->len, data, n);
+        for (i = 0; i < n; i++) {
+            iw->adler_a = (iw->adler_a + data[i]) % 65521;
+            iw->adler_b = (iw->adler_b + iw->adler_a) % 65521;
+        }
+        iw->len += n;
+        data += n;
+        len -= n;
+        if (iw->len == DEFLATE_STORED_MAX && (retval = png_flush_block(iw, 0)))
+            return retval;
+    }
+    return 0;
+}
+
+static errcode_t image_open(const char *path, __u32 width, __u32 height, struct image_writer *iw) {
+    const char *ext = strrchr(path, '.');
+    unsigned char ihdr[13];
+    errcode_t retval;
+
+    memset(iw, 0, sizeof(struct image_writer));
+    iw->png = ext && !strcasecmp(ext, ".png");
+    iw->width = width;
+    iw->f = fopen(path, "wb");
+    if (!iw->f)
+        return errno;
+
+    if (!iw->png) {
+        fprintf(iw->f, "P6\n%u %u\n255\n", width, height);
+        return 0;
+    }
+
+    crc32_init(iw->crc_table);
+    iw->adler_a = 1;
+    if (retval = ext2fs_get_mem(DEFLATE_STORED_MAX, &iw->block))
+        return retval;
+    if (fwrite("\x89PNG\r\n\x1a\n", 8, 1, iw->f) != 1)
+        return errno ? errno : EXT2_ET_SHORT_WRITE;
+    put_be32(ihdr, width);
+    put_be32(ihdr + 4, height);
+    ihdr[8] = 8;  // bit depth
+    ihdr[9] = 2;  // truecolour
+    ihdr[10] = 0; // deflate
+    ihdr[11] = 0; // adaptive filters
+    ihdr[12] = 0; // no interlace
+    return png_chunk(iw, "IHDR", ihdr, sizeof(ihdr));
+}
+
+static errcode_t image_write_row(struct image_writer *iw, const unsigned char *rgb) {
+    static const unsigned char filter_none = 0;
+    errcode_t retval;
+
+    if (!iw->png) {
+        if (fwrite(rgb, (size_t)iw->width * 3, 1, iw->f) != 1)
+            return errno ? errno : EXT2_ET_SHORT_WRITE;
+        return 0;
+    }
+    if (retval = png_write(iw, &filter_none, 1))
+        return retval;
+    return png_write(iw, rgb, (size_t)iw->width * 3);
+}
+
+static errcode_t image_close(struct image_writer *iw, errcode_t error) {
+    errcode_t retval = error;
+
+    if (!error && iw->png && !(retval = png_flush_block(iw, 1)))
+        retval = png_chunk(iw, "IEND", NULL, 0);
+    if (iw->f && fclose(iw->f) && !retval)
+        retval = errno;
+    ext2fs_free_mem(&iw->block);
+    return retval;
+}
+
+struct export_context {
+    unsigned char *band; // EXPORT_BAND_ROWS rows of rgb
+    __u32 width;
+    __u32 row0;  // first row of the band
+    __u32 rows;  // rows in the band
+    __u64 pixels;
+    blk64_t first;
+    blk64_t blocks;
+    int nthreads;
+};
+
+struct export_thread {
+    struct export_context *ctx;
+    int id;
+};
+
+static blk64_t pixel_first(struct export_context *ctx, __u64 p) {
+    return ctx->first + (blk64_t)((unsigned __int128)p * (ctx->blocks - ctx->first) / ctx->pixels);
+}
+
+static void render_pixel(struct export_context *ctx, __u64 p, unsigned char *rgb) {
+    blk64_t start = pixel_first(ctx, p), end = pixel_first(ctx, p + 1);
+    __u64 counts[BCLASS_MAX] = {0}, used;
+    const unsigned char *c;
+    double f;
+    int cls = BCLASS_DATA, i;
+
+    /* 像素比块多 */
+    if (end <= start) {
+        rgb[0] = rgb[1] = rgb[2] = 230;
+        return;
+    }
+
+    used = density_count(fs_density, fs->block_map, start, end);
+    if (used && fs_classes) {
+        class_map_count(fs_classes, start, end, counts);
+        cls = class_map_dominant(counts, used);
+    }
+    c = class_rgb[used ? cls : BCLASS_FREE];
+    f = (double)used / (end - start);
+    for (i = 0; i < 3; i++)
+        rgb[i] = 255 - (unsigned char)(f * (255 - c[i]));
+}
+
+/* 带内的行交错分给各线程 */
+static void *export_proc(void *arg) {
+    struct export_thread *et = (struct export_thread *)arg;
+    struct export_context *ctx = et->ctx;
+    __u32 r, x;
+
+    for (r = et->id; r < ctx->rows; r += ctx->nthreads)
+        for (x = 0; x < ctx->width; x++)
+            render_pixel(ctx, (__u64)(ctx->row0 + r) * ctx->width + x,
+                         ctx->band + ((size_t)r * ctx->width + x) * 3);
+    return NULL;
+}
+
+errcode_t export_image(const char *path, unsigned int width, unsigned int height) {
+    struct export_context ctx = {0};
+    struct export_thread *et = NULL;
+    struct image_writer iw;
+    errcode_t retval;
+    __u64 ts;
+    __u32 r;
+    int i;
+
+    if (!width || !height)
+        return EXT2_ET_INVALID_ARGUMENT;
+
+    ts = trace_now();
+    if (retval = bitmaps_load(fs, move_threads, NULL))
+        return retval;
+    if (!fs_density && (retval = density_build(fs, fs->block_map, move_threads, &fs_density)))
+        return retval;
+    if (!fs_classes) {
+        if ((retval = fs_index_load(fs)) || (retval = class_map_build(fs, fs_index, &fs_classes)))
+            return retval;
+    }
+    trace_span("export", "prepare", ts, NULL);
+
+    ctx.width = width;
+    ctx.pixels = (__u64)width * height;
+    ctx.first = fs->super->s_first_data_block;
+    ctx.blocks = ext2fs_blocks_count(fs->super);
+    ctx.nthreads = move_threads > 0 ? move_threads : 1;
+    if ((retval = ext2fs_get_array((size_t)width * 3, EXPORT_BAND_ROWS, &ctx.band))
+        || (retval = ext2fs_get_arrayzero(ctx.nthreads, sizeof(struct export_thread), &et)))
+        goto _free;
+
+    if (retval = image_open(path, width, height, &iw)) {
+        image_close(&iw, retval);
+        goto _free;
+    }
+
+    for (ctx.row0 = 0; ctx.row0 < height && !retval; ctx.row0 += ctx.rows) {
+        ctx.rows = height - ctx.row0 < EXPORT_BAND_ROWS ? height - ctx.row0 : EXPORT_BAND_ROWS;
+        ts = trace_now();
+        for (i = 0; i < ctx.nthreads; i++) {
+            et[i].ctx = &ctx;
+            et[i].id = i;
+        }
+        run_parallel(ctx.nthreads, export_proc, et, sizeof(struct export_thread));
+        trace_span("export", "render_band", ts, "\"row\":%u,\"rows\":%u", ctx.row0, ctx.rows);
+
+        for (r = 0; r < ctx.rows && !retval; r++)
+            retval = image_write_row(&iw, ctx.band + (size_t)r * width * 3);
+        fprintf(stderr, "\rRendering %s ... %u%%", path, (ctx.row0 + ctx.rows) * 100 / height);
+    }
+    fprintf(stderr, "\n");
+    retval = image_close(&iw, retval);
+
+_free:
+    ext2fs_free_mem(&ctx.band);
+    ext2fs_free_mem(&et);
+    return retval;
+}
@@ -0,0 +1,271 @@
+#include <time.h>
+
+#include "e2blk.h"
+
+/*
+ * 批量分析多个设备或镜像
+ *
+ * `-B list` reads one device or image path per line ('#' starts a comment,
+ * "-" is stdin) and analyses them on a pool of move_threads threads. Every
+ * filesystem is opened read-only with its own ext2_filsys and gets its own
+ * density map, extent index and class map, the globals of the interactive
+ * mode (fs, fs_index ...) are not touched. The results are written as one
+ * tab separated report in list order, with a total line at the end.
+ */
+
+#define FLEET_OPEN_FLAGS (EXT2_FLAG_SOFTSUPP_FEATURES | EXT2_FLAG_64BITS | EXT2_FLAG_THREADS)
+
+unsigned long long fleet_offset = 0; // bytes of the low region, 0 for none
+
+struct fleet_result {
+    char *name;
+    errcode_t error;
+    const char *stage; // what failed
+    unsigned int blocksize;
+    blk64_t blocks;
+    __u64 used;
+    blk64_t low;       // end of the low region, in blocks
+    __u64 low_used;
+    struct frag_stats frag;
+    struct move_estimate est;
+    struct bitmap_choice bmap;
+    double seconds;
+};
+
+struct fleet_context {
+    pthread_mutex_t lock;
+    struct fleet_result *res;
+    int count;
+    int next; // next device to analyse
+    int done;
+};
+
+static double fleet_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 每行一个路径, 去掉首尾空白 */
+static errcode_t read_list(const char *path, struct fleet_result **ret, int *count) {
+    struct fleet_result *res = NULL;
+    int n = 0, size = 0;
+    char line[4096], *s, *e;
+    errcode_t retval = 0;
+    FILE *f;
+
+    f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    if (!f)
+        return errno;
+
+    while (fgets(line, sizeof(line), f)) {
+        for (s = line; isspace(*s); s++)
+            ;
+        for (e = s + strlen(s); e > s && isspace(e[-1]); e--)
+            ;
+        *e = 0;
+        if (!*s || *s == '#')
+            continue;
+
+        if (n == size) {
+            int nsize = size ? size * 2 : 64;
+            if (retval = ext2fs_resize_array(sizeof(struct fleet_result), size, nsize, &res))
+                break;
+            size = nsize;
+        }
+        memset(res + n, 0, sizeof(struct fleet_result));
+        if (retval = ext2fs_get_mem(e - s + 1, &res[n].name))
+            break;
+        strcpy(res[n].name, s);
+        n++;
+    }
+    if (!retval && ferror(f))
+        retval = EIO;
+    if (f != stdin)
+        fclose(f);
+
+    if (retval) {
+        while (n--)
+            ext2fs_free_mem(&res[n].name);
+        ext2fs_free_mem(&res);
+        return retval;
+    }
+    *ret = res;
+    *count = n;
+    return 0;
+}
+
+static errcode_t fleet_analyse(struct fleet_result *r) {
+    ext2_filsys fs = NULL;
+    struct extent_index *idx = NULL;
+    struct density_map *dm = NULL;
+    struct class_map *cm = NULL;
+    struct frag_stats *frag = NULL;
+    blk64_t first;
+    errcode_t retval;
+
+    r->stage = "open";
+    if (retval = ext2fs_open(r->name, FLEET_OPEN_FLAGS, 0, 0, unix_io_manager, &fs))
+        return retval;
+    r->blocksize = fs->blocksize;
+    r->stage = "sample bitmaps";
+    if (retval = bitmap_choose(fs, bitmap_mode, &r->bmap))
+        goto _close;
+    r->blocks = ext2fs_blocks_count(fs->super);
+    first = fs->super->s_first_data_block;
+
+    /* 设备已经分到各个线程, 每个文件系统内部不再并行 */
+    r->stage = "read bitmaps";
+    if (retval = ext2fs_read_bitmaps(fs))
+        goto _close;
+    r->stage = "density";
+    if (retval = density_build(fs, fs->block_map, 1, &dm))
+        goto _close;
+    r->used = density_count(dm, fs->block_map, first, r->blocks);
+
+    r->stage = "index";
+    if (retval = extent_index_build(fs, &idx))
+        goto _close;
+    if (retval = frag_stats_compute(fs, idx, &frag))
+        goto _close;
+    r->frag = *frag;
+
+    if (fleet_offset) {
+        r->low = fleet_offset / r->blocksize;
+        if (r->low > r->blocks)
+            r->low = r->blocks;
+        if (r->low > first) {
+            r->stage = "estimate";
+            r->low_used = density_count(dm, fs->block_map, first, r->low);
+            if ((retval = class_map_build(fs, idx, &cm))
+                || (retval = move_estimate_fs(fs, idx, dm, cm, r->low, &r->est)))
+                goto _close;
+        }
+    }
+    r->stage = NULL;
+
+_close:
+    if (frag)
+        ext2fs_free_mem(&frag);
+    class_map_free(cm);
+    extent_index_free(idx);
+    density_free(dm);
+    ext2fs_close_free(&fs);
+    return retval;
+}
+
+static void *fleet_proc(void *arg) {
+    struct fleet_context *ctx = (struct fleet_context *)arg;
+    struct fleet_result *r;
+    double start;
+    __u64 ts;
+
+    trace_thread_name("fleet worker");
+    for (;;) {
+        pthread_mutex_lock(&ctx->lock);
+        if (ctx->next >= ctx->count) {
+            pthread_mutex_unlock(&ctx->lock);
+            break;
+        }
+        r = ctx->res + ctx->next++;
+        pthread_mutex_unlock(&ctx->lock);
+
+        start = fleet_now();
+        ts = trace_now();
+        r->error = fleet_analyse(r);
+        r->seconds = fleet_now() - start;
+        trace_span("fleet", "analyse", ts, "\"blocks\":%llu", (unsigned long long)r->blocks);
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->done++;
+        if (r->error)
+            fprintf(stderr, "[%d/%d] %s: %s while %s\n", ctx->done, ctx->count, r->name,
+                    error_message(r->error), r->stage);
+        else
+            fprintf(stderr, "[%d/%d] %s: %.1f s\n", ctx->done, ctx->count, r->name, r->seconds);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    return NULL;
+}
+
+static double percent(__u64 part, __u64 whole) {
+    return whole ? 100.0 * part / whole : 0;
+}
+
+static void write_report(FILE *f, struct fleet_result *res, int count, double seconds) {
+    __u64 blocks = 0, used = 0, move = 0, inodes = 0;
+    struct fleet_result *r;
+    int i, failed = 0, fits = 0;
+
+    fprintf(f, "# device\tblock_size\tblocks\tused_pct\tfiles\tfragmented_pct\textents\tfree_runs\tfree_max"
+               "\tlow_blocks\tlow_used_pct\tmove_blocks\tmove_inodes\tpinned\tfits\tbitmap\tseconds\n");
+    for (i = 0; i < count; i++) {
+        r = res + i;
+        if (r->error) {
+            fprintf(f, "%s\terror: %s while %s\n", r->name, error_message(r->error), r->stage);
+            failed++;
+            continue;
+        }
+        fprintf(f, "%s\t%u\t%llu\t%.1f\t%llu\t%.1f\t%llu\t%llu\t%llu", r->name, r->blocksize,
+                (unsigned long long)r->blocks, percent(r->used, r->blocks), (unsigned long long)r->frag.files,
+                percent(r->frag.fragmented, r->frag.files), (unsigned long long)r->frag.extents,
+                (unsigned long long)r->frag.free_runs, (unsigned long long)r->frag.free_max);
+        if (r->low)
+            fprintf(f, "\t%llu\t%.1f\t%llu\t%llu\t%llu\t%s", (unsigned long long)r->low,
+                    percent(r->low_used, r->low), (unsigned long long)r->est.blocks,
+                    (unsigned long long)r->est.inodes, (unsigned long long)r->est.pinned,
+                    r->est.free >= r->est.blocks ? "yes" : "no");
+        else
+            fprintf(f, "\t-\t-\t-\t-\t-\t-");
+        fprintf(f, "\t%s\t%.1f\n", bitmap_type_name[r->bmap.type], r->seconds);
+
+        blocks += r->blocks;
+        used += r->used;
+        move += r->est.blocks;
+        inodes += r->est.inodes;
+        if (r->low && r->est.free >= r->est.blocks)
+            fits++;
+    }
+    fprintf(f, "# total: %d devices, %d failed, %.1f%% used, %llu blocks of %llu inodes to move, %d can be cleared, %.1f s\n",
+            count, failed, percent(used, blocks), (unsigned long long)move, (unsigned long long)inodes, fits, seconds);
+}
+
+/*
+ * 分析 `list` 中的所有设备, 报告写到 `report` (NULL为标准输出).
+ * Returns an error only when the list or the report can not be used, a
+ * device that fails is reported on its own line.
+ */
+errcode_t fleet_run(const char *list, const char *report, int nthreads) {
+    struct fleet_context ctx = {PTHREAD_MUTEX_INITIALIZER};
+    errcode_t retval = 0;
+    double start = fleet_now();
+    FILE *f = stdout;
+    int i;
+
+    if (retval = read_list(list, &ctx.res, &ctx.count))
+        return retval;
+    if (report && !(f = fopen(report, "w"))) {
+        retval = errno;
+        goto _free;
+    }
+
+    if (nthreads > ctx.count)
+        nthreads = ctx.count;
+    if (nthreads < 1)
+        nthreads = 1;
+    /* 所有线程共用一个队列 */
+    run_parallel(nthreads, fleet_proc, &ctx, 0);
+
+    write_report(f, ctx.res, ctx.count, fleet_now() - start);
+    if (fflush(f) || ferror(f))
+        retval = EIO;
+
+_free:
+    if (f && f != stdout)
+        fclose(f);
+    for (i = 0; i < ctx.count; i++)
+        ext2fs_free_mem(&ctx.res[i].name);
+    ext2fs_free_mem(&ctx.res);
+    return retval;
+}
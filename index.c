@@ -0,0 +1,509 @@
+#include "e2blk.h"
+
+/*
+ * 物理块区间索引
+ *
+ * One pass over the inode table records every extent (and every block-mapped
+ * run) as a physical interval owned by (inode, logical block). The records are
+ * sorted by physical block so any disk range can be mapped back to its owners
+ * with a binary search instead of a per-block `icheck`.
+ */
+
+struct extent_index *fs_index = NULL;
+struct frag_stats *fs_frag = NULL;
+
+struct walk_runs_context {
+    struct extent_rec rec;
+    __u16 base;
+    int has;
+    int (*func)(const struct extent_rec *rec, void *priv);
+    void *priv;
+    int ret;
+};
+
+static int flush_run(struct walk_runs_context *ctx) {
+    if (!ctx->has)
+        return 0;
+    ctx->has = 0;
+    return ctx->ret = ctx->func(&ctx->rec, ctx->priv);
+}
+
+static int walk_blocks_proc(ext2_filsys fs EXT2FS_ATTR((unused)),
+                            blk64_t *blocknr,
+                            e2_blkcnt_t blockcnt,
+                            blk64_t ref_block EXT2FS_ATTR((unused)),
+                            int ref_offset EXT2FS_ATTR((unused)),
+                            void *private) {
+    struct walk_runs_context *ctx = (struct walk_runs_context *)private;
+    __u16 flags = ctx->base | (blockcnt < 0 ? EREC_META : 0);
+
+    if (ctx->has && ctx->rec.flags == flags && ctx->rec.pblk + ctx->rec.len == *blocknr
+        && ((flags & EREC_META) || ctx->rec.lblk + ctx->rec.len == (blk64_t)blockcnt)) {
+        ctx->rec.len++;
+        return 0;
+    }
+    if (flush_run(ctx))
+        return BLOCK_ABORT;
+
+    ctx->rec.pblk = *blocknr;
+    ctx->rec.lblk = blockcnt < 0 ? 0 : blockcnt;
+    ctx->rec.len = 1;
+    ctx->rec.flags = flags;
+    ctx->has = 1;
+
+    return 0;
+}
+
+/*
+ * Call `func` for every physical run of one inode: data extents, extent tree
+ * nodes / indirect blocks (EREC_META) and the xattr block.
+ */
+errcode_t inode_walk_runs(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
+                          int (*func)(const struct extent_rec *rec, void *priv), void *priv) {
+    struct walk_runs_context ctx = {0};
+    struct ext2fs_extent extent;
+    ext2_extent_handle_t handle;
+    errcode_t retval = 0;
+    __u16 base = 0;
+    blk64_t blk;
+    int op;
+
+    if (ino < EXT2_FIRST_INODE(fs->super) && ino != EXT2_ROOT_INO)
+        base |= EREC_RSV;
+    if (LINUX_S_ISDIR(inode->i_mode))
+        base |= EREC_DIR;
+
+    ctx.func = func;
+    ctx.priv = priv;
+    ctx.base = base;
+    ctx.rec.ino = ino;
+
+    if ((blk = ext2fs_file_acl_block(fs, inode))) {
+        ctx.rec.pblk = blk;
+        ctx.rec.lblk = 0;
+        ctx.rec.len = 1;
+        ctx.rec.flags = base | EREC_META;
+        if (func(&ctx.rec, priv))
+            return 0;
+    }
+
+    if (!ext2fs_inode_has_valid_blocks2(fs, inode))
+        return 0;
+
+    if (!(inode->i_flags & EXT4_EXTENTS_FL)) {
+        retval = ext2fs_block_iterate3(fs, ino, BLOCK_FLAG_READ_ONLY, NULL, walk_blocks_proc, &ctx);
+        if (!retval && !ctx.ret)
+            flush_run(&ctx);
+        return retval;
+    }
+
+    if (retval = ext2fs_extent_open2(fs, ino, inode, &handle))
+        return retval;
+
+    for (op = EXT2_EXTENT_ROOT;; op = EXT2_EXTENT_NEXT) {
+        retval = ext2fs_extent_get(handle, op, &extent);
+        if (retval) {
+            if (retval == EXT2_ET_EXTENT_NO_NEXT)
+                retval = 0;
+            break;
+        }
+        if (extent.e_flags & EXT2_EXTENT_FLAGS_SECOND_VISIT)
+            continue;
+
+        ctx.rec.pblk = extent.e_pblk;
+        ctx.rec.flags = base | EREC_EXTENT;
+        if (extent.e_flags & EXT2_EXTENT_FLAGS_LEAF) {
+            ctx.rec.lblk = extent.e_lblk;
+            ctx.rec.len = extent.e_len;
+            if (extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT)
+                ctx.rec.flags |= EREC_UNINIT;
+        } else {
+            /* 索引节点, e_pblk 是下一层树块 */
+            ctx.rec.lblk = 0;
+            ctx.rec.len = 1;
+            ctx.rec.flags |= EREC_META;
+        }
+        if (ctx.rec.len == 0)
+            continue;
+        if (func(&ctx.rec, priv))
+            break;
+    }
+
+    ext2fs_extent_free(handle);
+    return retval;
+}
+
+struct index_build_context {
+    struct extent_index *idx;
+    struct spill_runs runs; // sorted runs written out under a memory limit
+    errcode_t error;
+};
+
+static int extent_rec_cmp(const void *a, const void *b) {
+    const struct extent_rec *ra = a, *rb = b;
+
+    if (ra->pblk != rb->pblk)
+        return ra->pblk < rb->pblk ? -1 : 1;
+    if (ra->ino != rb->ino)
+        return ra->ino < rb->ino ? -1 : 1;
+    return 0;
+}
+
+static int index_add_rec(const struct extent_rec *rec, void *priv) {
+    struct index_build_context *ctx = (struct index_build_context *)priv;
+    struct extent_index *idx = ctx->idx;
+    struct extent_rec *r;
+
+    /* 超出排序缓冲区, 排好序写成一段 */
+    if (idx->count && spill_run_bytes() && idx->count * sizeof(struct extent_rec) >= spill_run_bytes()) {
+        qsort(idx->recs, idx->count, sizeof(struct extent_rec), extent_rec_cmp);
+        if (ctx->error = spill_write_run(&ctx->runs, idx->recs, idx->count))
+            return 1;
+        idx->count = 0;
+    }
+
+    if (idx->count == idx->size) {
+        __u64 size = idx->size ? idx->size * 2 : 4096;
+        if (ctx->error = ext2fs_resize_array(sizeof(struct extent_rec), idx->size, size, &idx->recs))
+            return 1;
+        idx->size = size;
+    }
+    r = idx->recs + idx->count++;
+    *r = *rec;
+    if (r->len > idx->max_len)
+        idx->max_len = r->len;
+
+    return 0;
+}
+
+errcode_t extent_index_build(ext2_filsys fs, struct extent_index **ret) {
+    struct index_build_context ctx = {0};
+    struct extent_index *idx;
+    struct ext2_inode *inode;
+    ext2_inode_scan scan;
+    ext2_ino_t ino, scanned = 0;
+    errcode_t retval;
+    int inode_size = EXT2_INODE_SIZE(fs->super);
+    dgrp_t group = 0;
+    __u64 ts = trace_now();
+
+    if (retval = ext2fs_get_memzero(sizeof(struct extent_index), &idx))
+        return retval;
+    idx->inodes = fs->super->s_inodes_count;
+    ctx.idx = idx;
+    ctx.runs.rec_size = sizeof(struct extent_rec);
+
+    if (retval = ext2fs_get_mem(inode_size, &inode))
+        goto _error;
+
+    if (retval = ext2fs_open_inode_scan(fs, 0, &scan))
+        goto _free_inode;
+    ext2fs_inode_scan_flags(scan, EXT2_SF_SKIP_MISSING_ITABLE, 0);
+
+    for (;;) {
+        retval = ext2fs_get_next_inode_full(scan, &ino, inode, inode_size);
+        if (retval == EXT2_ET_BAD_BLOCK_IN_INODE_TABLE)
+            continue;
+        if (retval || ino == 0)
+            break;
+
+        /* 每个块组一个区间 */
+        if (trace_file && (ino - 1) / fs->super->s_inodes_per_group != group) {
+            trace_span("scan", "inode_scan_group", ts, "\"group\":%u,\"inodes\":%u", group, scanned);
+            group = (ino - 1) / fs->super->s_inodes_per_group;
+            scanned = 0;
+            ts = trace_now();
+        }
+        scanned++;
+
+        if (inode->i_links_count == 0 && ino >= EXT2_FIRST_INODE(fs->super))
+            continue;
+        if (ino == EXT2_BAD_INO)
+            continue;
+
+        if (retval = inode_walk_runs(fs, ino, inode, index_add_rec, &ctx))
+            break;
+        if (retval = ctx.error)
+            break;
+    }
+    ext2fs_close_inode_scan(scan);
+    trace_span("scan", "inode_scan_group", ts, "\"group\":%u,\"inodes\":%u", group, scanned);
+
+    if (retval)
+        goto _free_inode;
+
+    ts = trace_now();
+    qsort(idx->recs, idx->count, sizeof(struct extent_rec), extent_rec_cmp);
+    if (ctx.runs.nruns) {
+        /* 归并所有分段, 结果超出预算时映射在临时文件上 */
+        if (retval = spill_write_run(&ctx.runs, idx->recs, idx->count))
+            goto _free_inode;
+        ext2fs_free_mem(&idx->recs);
+        if (retval = spill_merge_runs(&ctx.runs, extent_rec_cmp, (void **)&idx->recs))
+            goto _free_inode;
+        idx->count = idx->size = ctx.runs.total;
+    }
+    trace_span("scan", "index_sort", ts, "\"records\":%llu,\"runs\":%d",
+               (unsigned long long)idx->count, ctx.runs.nruns);
+    spill_runs_free(&ctx.runs);
+    ext2fs_free_mem(&inode);
+    *ret = idx;
+    return 0;
+
+_free_inode:
+    spill_runs_free(&ctx.runs);
+    ext2fs_free_mem(&inode);
+_error:
+    extent_index_free(idx);
+    return retval;
+}
+
+void extent_index_free(struct extent_index *idx) {
+    if (!idx)
+        return;
+    if (!idx->mapped)
+        spill_free(&idx->recs);
+    spill_free(&idx->parent);
+    ext2fs_free_mem(&idx);
+}
+
+/*
+ * Index of the first record that may overlap `blk`.
+ * Records are sorted by start only, so step back by the longest record.
+ */
+__u64 extent_index_find(struct extent_index *idx, blk64_t blk) {
+    __u64 lo = 0, hi = idx->count, mid;
+    blk64_t start = blk > idx->max_len ? blk - idx->max_len : 0;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (idx->recs[mid].pblk < start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    while (lo < idx->count && idx->recs[lo].pblk + idx->recs[lo].len <= blk)
+        lo++;
+
+    return lo;
+}
+
+static int owner_ino_cmp(const void *a, const void *b) {
+    const struct index_owner *oa = a, *ob = b;
+
+    if (oa->ino != ob->ino)
+        return oa->ino < ob->ino ? -1 : 1;
+    return 0;
+}
+
+static int owner_blocks_cmp(const void *a, const void *b) {
+    const struct index_owner *oa = a, *ob = b;
+
+    if (oa->blocks != ob->blocks)
+        return oa->blocks > ob->blocks ? -1 : 1;
+    return oa->ino < ob->ino ? -1 : 1;
+}
+
+/*
+ * List the inodes owning blocks in [start, end), sorted by the number of
+ * blocks each one holds in the range. The caller frees `*ret`.
+ */
+errcode_t extent_index_owners(struct extent_index *idx, blk64_t start, blk64_t end,
+                              struct index_owner **ret, int *count) {
+    struct index_owner *list = NULL;
+    struct extent_rec *r;
+    blk64_t s, e;
+    __u64 i, n = 0, size = 0;
+    errcode_t retval;
+
+    for (i = extent_index_find(idx, start); i < idx->count; i++) {
+        r = idx->recs + i;
+        if (r->pblk >= end)
+            break;
+        s = r->pblk > start ? r->pblk : start;
+        e = r->pblk + r->len < end ? r->pblk + r->len : end;
+        if (s >= e)
+            continue;
+
+        if (n == size) {
+            __u64 nsize = size ? size * 2 : 64;
+            if (retval = ext2fs_resize_array(sizeof(struct index_owner), size, nsize, &list)) {
+                ext2fs_free_mem(&list);
+                return retval;
+            }
+            size = nsize;
+        }
+        list[n].ino = r->ino;
+        list[n].flags = r->flags;
+        list[n].blocks = e - s;
+        n++;
+    }
+
+    if (n) {
+        __u64 j = 0;
+
+        qsort(list, n, sizeof(struct index_owner), owner_ino_cmp);
+        for (i = 1; i < n; i++) {
+            if (list[i].ino == list[j].ino) {
+                list[j].blocks += list[i].blocks;
+                list[j].flags |= list[i].flags;
+            } else
+                list[++j] = list[i];
+        }
+        n = j + 1;
+        qsort(list, n, sizeof(struct index_owner), owner_blocks_cmp);
+    }
+
+    *ret = list;
+    *count = (int)n;
+    return 0;
+}
+
+struct parent_context {
+    struct extent_index *idx;
+};
+
+static int parent_dir_proc(ext2_ino_t dir,
+                           int entry,
+                           struct ext2_dir_entry *dirent,
+                           int offset EXT2FS_ATTR((unused)),
+                           int blocksize EXT2FS_ATTR((unused)),
+                           char *buf EXT2FS_ATTR((unused)),
+                           void *priv) {
+    struct parent_context *ctx = (struct parent_context *)priv;
+
+    if (entry == DIRENT_DOT_FILE || entry == DIRENT_DOT_DOT_FILE)
+        return 0;
+    if (dirent->inode == 0 || dirent->inode > ctx->idx->inodes)
+        return 0;
+    if (ctx->idx->parent[dirent->inode] == 0)
+        ctx->idx->parent[dirent->inode] = dir;
+
+    return 0;
+}
+
+/*
+ * 遍历目录树, 记录每个inode的父目录 (硬链接取第一个).
+ * Directory inodes are taken from the index itself, so no second inode scan.
+ */
+static errcode_t build_parent_map(ext2_filsys fs, struct extent_index *idx) {
+    struct parent_context ctx;
+    errcode_t retval;
+    __u64 i;
+
+    if (retval = spill_get_arrayzero(sizeof(ext2_ino_t), idx->inodes + 1, &idx->parent))
+        return retval;
+
+    ctx.idx = idx;
+    idx->parent[EXT2_ROOT_INO] = EXT2_ROOT_INO;
+    for (i = 0; i < idx->count; i++) {
+        struct extent_rec *r = idx->recs + i;
+
+        /* 每个目录只有一个逻辑块0的记录 */
+        if (!(r->flags & EREC_DIR) || (r->flags & EREC_META) || r->lblk != 0)
+            continue;
+        ext2fs_dir_iterate2(fs, r->ino, 0, NULL, parent_dir_proc, &ctx);
+    }
+
+    return 0;
+}
+
+/* 按需建立父目录表, idx->parent[ino] 为0表示未知 */
+errcode_t extent_index_parents(ext2_filsys fs, struct extent_index *idx) {
+    if (idx->parent)
+        return 0;
+    return build_parent_map(fs, idx);
+}
+
+errcode_t extent_index_pathname(ext2_filsys fs, struct extent_index *idx, ext2_ino_t ino, char **name) {
+    errcode_t retval;
+
+    if (retval = extent_index_parents(fs, idx))
+        return retval;
+
+    if (ino <= idx->inodes && idx->parent[ino] && ino != EXT2_ROOT_INO) {
+        struct ext2_inode inode;
+
+        if (!ext2fs_read_inode(fs, ino, &inode) && LINUX_S_ISDIR(inode.i_mode))
+            return ext2fs_get_pathname(fs, ino, 0, name);
+        return ext2fs_get_pathname(fs, idx->parent[ino], ino, name);
+    }
+
+    return ext2fs_get_pathname(fs, ino, 0, name);
+}
+
+/*
+ * 碎片统计: extents per file from the index, free extents from the block
+ * bitmap.
+ */
+errcode_t frag_stats_compute(ext2_filsys fs, struct extent_index *idx, struct frag_stats **ret) {
+    blk64_t blk, end = ext2fs_blocks_count(fs->super) - 1, s, e;
+    struct frag_stats *st;
+    struct extent_rec *r;
+    errcode_t retval;
+    __u32 *runs;
+    __u64 i;
+
+    if (retval = bitmaps_load(fs, move_threads, NULL))
+        return retval;
+    if (retval = ext2fs_get_memzero(sizeof(struct frag_stats), &st))
+        return retval;
+    if (retval = spill_get_arrayzero(sizeof(__u32), idx->inodes + 1, &runs)) {
+        ext2fs_free_mem(&st);
+        return retval;
+    }
+
+    for (i = 0; i < idx->count; i++) {
+        r = idx->recs + i;
+        if (r->flags & (EREC_META | EREC_RSV) || r->ino > idx->inodes)
+            continue;
+        runs[r->ino]++;
+    }
+    for (i = 1; i <= idx->inodes; i++) {
+        if (!runs[i])
+            continue;
+        st->files++;
+        st->extents += runs[i];
+        if (runs[i] > 1)
+            st->fragmented++;
+        if (runs[i] > st->max_extents) {
+            st->max_extents = runs[i];
+            st->max_ino = i;
+        }
+    }
+    spill_free(&runs);
+
+    for (blk = fs->super->s_first_data_block; blk <= end; blk = e) {
+        if (ext2fs_find_first_zero_block_bitmap2(fs->block_map, blk, end, &s))
+            break;
+        if (ext2fs_find_first_set_block_bitmap2(fs->block_map, s, end, &e))
+            e = end + 1;
+        st->free_runs++;
+        if (e - s > st->free_max)
+            st->free_max = e - s;
+    }
+
+    *ret = st;
+    return 0;
+}
+
+/* 建立区间索引和碎片统计, 已有 (或从扫描缓存载入) 则跳过 */
+errcode_t fs_index_load(ext2_filsys fs) {
+    errcode_t retval;
+    __u64 ts;
+
+    if (!fs_index) {
+        ts = trace_now();
+        if (retval = extent_index_build(fs, &fs_index))
+            return retval;
+        trace_span("scan", "extent_index_build", ts, "\"records\":%llu", (unsigned long long)fs_index->count);
+    }
+    if (!fs_frag) {
+        ts = trace_now();
+        if (retval = frag_stats_compute(fs, fs_index, &fs_frag))
+            return retval;
+        trace_span("scan", "frag_stats", ts, NULL);
+    }
+
+    return 0;
+}
@@ -0,0 +1,304 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
+
+#include "e2blk.h"
+
+/*
+ * 基于mmap的io_manager
+ *
+ * For filesystem images: the whole file is mapped shared and blocks are
+ * served with memcpy from the page cache, no syscall per block. Sequential
+ * reads trigger madvise(MADV_WILLNEED) on the next window. Writes go
+ * through pwrite: storing into a hole of a sparse image (-d punches them)
+ * through the mapping raises SIGBUS on ENOSPC instead of returning an
+ * error. The shared mapping sees them through the page cache.
+ */
+
+#define MMAP_READAHEAD (2 * 1024 * 1024)
+#define MMAP_ZERO_CHUNK (1024 * 1024) // zeros written per pwrite without ZERO_RANGE
+
+struct mmap_private_data {
+    int fd;
+    int flags;
+    char *map;
+    __u64 size;
+    __u64 next;      // byte after the last read, for readahead
+    __u64 ra_end;    // readahead issued up to here
+    struct struct_io_stats io_stats;
+};
+
+static struct struct_io_manager struct_mmap_manager;
+io_manager mmap_io_manager = &struct_mmap_manager;
+
+static errcode_t mmap_open(const char *name, int flags, io_channel *channel) {
+    struct mmap_private_data *data = NULL;
+    io_channel io = NULL;
+    errcode_t retval;
+    struct stat st;
+
+    if (name == 0)
+        return EXT2_ET_BAD_DEVICE_NAME;
+
+    if (retval = ext2fs_get_memzero(sizeof(struct struct_io_channel), &io))
+        return retval;
+    if (retval = ext2fs_get_memzero(sizeof(struct mmap_private_data), &data))
+        goto _error;
+    if (retval = ext2fs_get_mem(strlen(name) + 1, &io->name))
+        goto _error;
+    strcpy(io->name, name);
+
+    io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+    io->manager = mmap_io_manager;
+    io->block_size = 1024;
+    io->refcount = 1;
+    io->flags = 0;
+    io->private_data = data;
+
+    data->flags = flags;
+    data->io_stats.num_fields = 2;
+    data->fd = open(name, (flags & IO_FLAG_RW) ? O_RDWR : O_RDONLY);
+    if (data->fd < 0) {
+        retval = errno;
+        goto _error;
+    }
+    if (fstat(data->fd, &st) < 0) {
+        retval = errno;
+        goto _close;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+        retval = EXT2_ET_UNIMPLEMENTED;
+        goto _close;
+    }
+
+    data->size = st.st_size;
+    data->map = mmap(NULL, data->size, PROT_READ, MAP_SHARED, data->fd, 0);
+    if (data->map == MAP_FAILED) {
+        retval = errno;
+        goto _close;
+    }
+    madvise(data->map, data->size, MADV_RANDOM);
+
+    *channel = io;
+    return 0;
+
+_close:
+    close(data->fd);
+_error:
+    if (io)
+        ext2fs_free_mem(&io->name);
+    ext2fs_free_mem(&data);
+    ext2fs_free_mem(&io);
+    return retval;
+}
+
+static errcode_t mmap_close(io_channel channel) {
+    struct mmap_private_data *data = channel->private_data;
+    errcode_t retval = 0;
+
+    if (--channel->refcount > 0)
+        return 0;
+
+    if ((data->flags & IO_FLAG_RW) && fsync(data->fd) < 0)
+        retval = errno;
+    munmap(data->map, data->size);
+    if (close(data->fd) < 0 && !retval)
+        retval = errno;
+
+    ext2fs_free_mem(&channel->private_data);
+    ext2fs_free_mem(&channel->name);
+    ext2fs_free_mem(&channel);
+    return retval;
+}
+
+static errcode_t mmap_set_blksize(io_channel channel, int blksize) {
+    channel->block_size = blksize;
+    return 0;
+}
+
+/* 顺序读时预读下一个窗口 */
+static void mmap_readahead(struct mmap_private_data *data, __u64 offset, size_t size) {
+    __u64 start, end;
+
+    if (offset != data->next) {
+        data->next = offset + size;
+        return;
+    }
+    data->next = offset + size;
+    if (data->next + MMAP_READAHEAD / 2 < data->ra_end)
+        return;
+
+    start = data->next > data->ra_end ? data->next : data->ra_end;
+    start &= ~((__u64)sysconf(_SC_PAGESIZE) - 1);
+    end = start + MMAP_READAHEAD;
+    if (end > data->size)
+        end = data->size;
+    if (start < end)
+        madvise(data->map + start, end - start, MADV_WILLNEED);
+    data->ra_end = end;
+}
+
+static errcode_t mmap_read_blk64(io_channel channel, unsigned long long block, int count, void *buf) {
+    struct mmap_private_data *data = channel->private_data;
+    size_t size = count < 0 ? (size_t)-count : (size_t)count * channel->block_size;
+    __u64 offset = (__u64)block * channel->block_size;
+
+    if (offset >= data->size) {
+        memset(buf, 0, size);
+        return EXT2_ET_SHORT_READ;
+    }
+    if (offset + size > data->size) {
+        __u64 n = data->size - offset;
+
+        memcpy(buf, data->map + offset, n);
+        memset((char *)buf + n, 0, size - n);
+        data->io_stats.bytes_read += n;
+        return EXT2_ET_SHORT_READ;
+    }
+
+    mmap_readahead(data, offset, size);
+    memcpy(buf, data->map + offset, size);
+    data->io_stats.bytes_read += size;
+    return 0;
+}
+
+static errcode_t mmap_read_blk(io_channel channel, unsigned long block, int count, void *buf) {
+    return mmap_read_blk64(channel, block, count, buf);
+}
+
+static errcode_t write_full(int fd, __u64 offset, size_t size, const void *buf) {
+    ssize_t n;
+
+    while (size) {
+        n = pwrite(fd, buf, size, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        if (n == 0)
+            return EXT2_ET_SHORT_WRITE;
+        buf = (const char *)buf + n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static errcode_t mmap_write_bytes(io_channel channel, __u64 offset, size_t size, const void *buf) {
+    struct mmap_private_data *data = channel->private_data;
+    errcode_t retval;
+
+    if (!(data->flags & IO_FLAG_RW))
+        return EXT2_ET_RO_FILSYS;
+    if (offset + size > data->size)
+        return EXT2_ET_SHORT_WRITE;
+
+    if (retval = write_full(data->fd, offset, size, buf))
+        return retval;
+    data->io_stats.bytes_written += size;
+    return 0;
+}
+
+static errcode_t mmap_write_blk64(io_channel channel, unsigned long long block, int count, const void *buf) {
+    size_t size = count < 0 ? (size_t)-count : (size_t)count * channel->block_size;
+
+    return mmap_write_bytes(channel, (__u64)block * channel->block_size, size, buf);
+}
+
+static errcode_t mmap_write_blk(io_channel channel, unsigned long block, int count, const void *buf) {
+    return mmap_write_blk64(channel, block, count, buf);
+}
+
+static errcode_t mmap_write_byte(io_channel channel, unsigned long offset, int size, const void *buf) {
+    return mmap_write_bytes(channel, offset, size, buf);
+}
+
+/* 提交点: 写回脏页 */
+static errcode_t mmap_flush(io_channel channel) {
+    struct mmap_private_data *data = channel->private_data;
+
+    if ((data->flags & IO_FLAG_RW) && fsync(data->fd) < 0)
+        return errno;
+    return 0;
+}
+
+static errcode_t mmap_set_option(io_channel channel EXT2FS_ATTR((unused)), const char *option, const char *arg EXT2FS_ATTR((unused))) {
+    /* 没有块缓存, 页缓存与pread/pwrite一致 */
+    if (!strcmp(option, "cache"))
+        return 0;
+    return EXT2_ET_INVALID_ARGUMENT;
+}
+
+static errcode_t mmap_get_stats(io_channel channel, io_stats *stats) {
+    struct mmap_private_data *data = channel->private_data;
+
+    if (stats)
+        *stats = &data->io_stats;
+    return 0;
+}
+
+static errcode_t mmap_discard(io_channel channel, unsigned long long block, unsigned long long count) {
+    struct mmap_private_data *data = channel->private_data;
+
+    if (fallocate(data->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)block * channel->block_size, (off_t)count * channel->block_size) < 0)
+        return errno == EOPNOTSUPP ? EXT2_ET_UNIMPLEMENTED : errno;
+    return 0;
+}
+
+static errcode_t mmap_cache_readahead(io_channel channel, unsigned long long block, unsigned long long count) {
+    struct mmap_private_data *data = channel->private_data;
+    __u64 start = (__u64)block * channel->block_size, end = start + (__u64)count * channel->block_size;
+
+    start &= ~((__u64)sysconf(_SC_PAGESIZE) - 1);
+    if (end > data->size)
+        end = data->size;
+    if (start < end && madvise(data->map + start, end - start, MADV_WILLNEED) < 0)
+        return errno;
+    return 0;
+}
+
+static errcode_t mmap_zeroout(io_channel channel, unsigned long long block, unsigned long long count) {
+    struct mmap_private_data *data = channel->private_data;
+    __u64 offset = (__u64)block * channel->block_size, size = (__u64)count * channel->block_size, n;
+    errcode_t retval = 0;
+    char *zero;
+
+    if (!(data->flags & IO_FLAG_RW))
+        return EXT2_ET_RO_FILSYS;
+    if (offset + size > data->size)
+        return EXT2_ET_SHORT_WRITE;
+    if (fallocate(data->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, size) == 0)
+        return 0;
+
+    if (retval = ext2fs_get_memzero(MMAP_ZERO_CHUNK, &zero))
+        return retval;
+    for (; size && !retval; offset += n, size -= n) {
+        n = size < MMAP_ZERO_CHUNK ? size : MMAP_ZERO_CHUNK;
+        retval = write_full(data->fd, offset, n, zero);
+    }
+    ext2fs_free_mem(&zero);
+    return retval;
+}
+
+static struct struct_io_manager struct_mmap_manager = {
+    .magic = EXT2_ET_MAGIC_IO_MANAGER,
+    .name = "mmap I/O Manager",
+    .open = mmap_open,
+    .close = mmap_close,
+    .set_blksize = mmap_set_blksize,
+    .read_blk = mmap_read_blk,
+    .write_blk = mmap_write_blk,
+    .flush = mmap_flush,
+    .write_byte = mmap_write_byte,
+    .set_option = mmap_set_option,
+    .get_stats = mmap_get_stats,
+    .read_blk64 = mmap_read_blk64,
+    .write_blk64 = mmap_write_blk64,
+    .discard = mmap_discard,
+    .cache_readahead = mmap_cache_readahead,
+    .zeroout = mmap_zeroout,
+};
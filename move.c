@@ -4,153 +4,1223 @@
 
 #include "e2blk.h"
 
-struct inode_search_context {
-    e2_blkcnt_t block;
-    int ret;
+/*
+ * 多线程移动引擎
+ *
+ * 1. plan: every run of the extent index inside the low region gets a
+ *    pre-reserved destination range outside of it (struct move_task).
+ * 2. copy: worker threads copy the tasks of different inodes in parallel
+ *    through their own copy_channel.
+ * 3. commit: once all tasks of an inode are on disk it is queued to the
+ *    committer, the only thread calling libext2fs, which rewrites the block
+ *    pointers and updates the bitmaps.
+ *
+ * 放置策略 (move_locality): inodes are planned directory by directory, a
+ * directory first and then the files in it, so a later traversal reads
+ * them in one sweep. Each file gets one free extent large enough for all
+ * of it when there is one near the goal, and each directory starts at the
+ * first block of its inode's (flex) group when that lies outside the
+ * cleared region. Without it blocks take the first free block after the
+ * previous one.
+ */
+
+#define MOVE_BATCH_BLOCKS 1024 // max blocks per task
+#define MOVE_EXTENT_SCAN 256   // free extents looked at per file
+#define MOVE_SYNC_TASKS 32     // copied tasks per fdatasync
+
+int move_threads = 4;
+int move_verify = 0;
+int move_zero = 0;
+int move_discard = 0;
+int move_locality = 1;
+
+struct move_inode {
+    ext2_ino_t ino;
+    __u64 first;   // index of the first task
+    __u32 ntasks;
+    __u32 pending; // tasks not copied yet
+    int deferred;  // shares blocks with another inode, committed last
+    int committed;
+    errcode_t error;
+    struct move_inode *next;
 };
 
-static int inode_blocks_proc(ext2_filsys fs EXT2FS_ATTR((unused)),
-                             blk64_t *blocknr,
-                             e2_blkcnt_t blockcnt EXT2FS_ATTR((unused)),
-                             blk64_t ref_block EXT2FS_ATTR((unused)),
-                             int ref_offset EXT2FS_ATTR((unused)),
-                             void *private) {
-    struct inode_search_context *ctx = (struct inode_search_context *)private;
+struct move_task {
+    blk64_t src;
+    blk64_t dst;
+    blk64_t lblk;
+    __u32 len;
+    __u16 flags; // EREC_*
+    __u8 zero;   // source is all zero, mapped as unwritten on commit
+    __u8 offloaded; // copied inside the image by the kernel, no source crc
+    __u32 crc;   // crc32c of the source, when verifying
+    struct move_inode *mi;
+    struct move_task *vnext;
+};
+
+struct move_engine {
+    blk64_t offset; // blocks [first_data_block, offset) are cleared
+    ext2fs_block_bitmap alloc_map;
+    ext2fs_block_bitmap planned;
+    blk64_t cursor; // next destination candidate
+    blk64_t goal;   // first block of the current directory's group
+
+    struct move_task *tasks;
+    __u64 ntasks, tasks_size;
+    struct move_task **reloc; // tasks sorted by src
+    struct move_inode *inodes;
+    __u64 ninodes, inodes_size;
+    __u64 pinned; // used blocks in region that can not be moved
+    __u64 contiguous; // inodes placed in a single extent
+    ext2_ino_t *shared;
+    __u64 nshared;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    __u64 next_task;
+    int running;   // workers alive
+    int verifying; // verifier alive
+    int abort;
+    struct move_inode *commit_head, *commit_tail;
+    struct move_task *verify_head, *verify_tail;
+    struct rate_limit rate; // copy and verify I/O
+
+    __u64 copied;    // blocks
+    __u64 skipped;   // blocks not copied, unwritten or zero
+    __u64 offloaded; // blocks copied with copy_file_range
+    __u64 cloned;    // blocks shared with FICLONERANGE
+    __u64 verified;  // blocks
+    __u64 committed; // inodes
+    __u64 moved;     // blocks
+    __u64 discarded; // blocks
+    errcode_t discard_error; // only a warning, the move itself is complete
+    int released;    // source blocks of deferred inodes are free
+    errcode_t error;
+};
+
+static int move_rec_cmp(const void *a, const void *b) {
+    const struct extent_rec *ra = a, *rb = b;
+
+    if (ra->ino != rb->ino)
+        return ra->ino < rb->ino ? -1 : 1;
+    if ((ra->flags & EREC_META) != (rb->flags & EREC_META))
+        return (ra->flags & EREC_META) ? 1 : -1;
+    if (ra->lblk != rb->lblk)
+        return ra->lblk < rb->lblk ? -1 : 1;
+    return ra->pblk < rb->pblk ? -1 : ra->pblk > rb->pblk;
+}
+
+static int move_task_src_cmp(const void *a, const void *b) {
+    const struct move_task *ta = *(const struct move_task **)a, *tb = *(const struct move_task **)b;
 
-    if (*blocknr == ctx->block) {
-        ctx->ret = 1;
-        return BLOCK_ABORT;
+    return ta->src < tb->src ? -1 : ta->src > tb->src;
+}
+
+static errcode_t add_task(struct move_engine *me, blk64_t src, blk64_t dst, blk64_t lblk, __u32 len, __u16 flags) {
+    struct move_task *t;
+    errcode_t retval;
+
+    if (me->ntasks == me->tasks_size) {
+        __u64 size = me->tasks_size ? me->tasks_size * 2 : 1024;
+        if (retval = spill_resize_array(sizeof(struct move_task), me->tasks_size, size, &me->tasks))
+            return retval;
+        me->tasks_size = size;
+    }
+    t = me->tasks + me->ntasks++;
+    t->src = src;
+    t->dst = dst;
+    t->lblk = lblk;
+    t->len = len;
+    t->flags = flags;
+    t->zero = 0;
+    t->mi = (struct move_inode *)(uintptr_t)me->ninodes; // index, fixed up after planning
+
+    return 0;
+}
+
+/*
+ * 为 [src, src + len) 分配目标块, 可能拆成多个任务
+ */
+static errcode_t plan_run(struct move_engine *me, blk64_t src, blk64_t lblk, __u32 len, __u16 flags) {
+    blk64_t start, end, last = ext2fs_blocks_count(fs->super) - 1;
+    errcode_t retval;
+    __u32 n;
+
+    while (len) {
+        if (me->cursor > last)
+            me->cursor = me->offset;
+        retval = ext2fs_find_first_zero_block_bitmap2(me->alloc_map, me->cursor, last, &start);
+        if (retval && me->cursor != me->offset) {
+            me->cursor = me->offset;
+            retval = ext2fs_find_first_zero_block_bitmap2(me->alloc_map, me->cursor, last, &start);
+        }
+        if (retval)
+            return EXT2_ET_BLOCK_ALLOC_FAIL;
+
+        if (ext2fs_find_first_set_block_bitmap2(me->alloc_map, start, last, &end))
+            end = last + 1;
+
+        n = end - start < len ? end - start : len;
+        if (n > MOVE_BATCH_BLOCKS)
+            n = MOVE_BATCH_BLOCKS;
+
+        ext2fs_mark_block_bitmap_range2(me->alloc_map, start, n);
+        if (retval = add_task(me, src, start, lblk, n, flags))
+            return retval;
+
+        me->cursor = start + n;
+        src += n;
+        lblk += n;
+        len -= n;
     }
 
-    // printf("%d, ", *blocknr);
+    return 0;
+}
+
+static int ino_cmp(const void *a, const void *b) {
+    ext2_ino_t ia = *(const ext2_ino_t *)a, ib = *(const ext2_ino_t *)b;
+
+    return ia < ib ? -1 : ia > ib;
+}
+
+/*
+ * 找出低区内被多个inode引用的块 (共享的xattr块等).
+ * `recs` is sorted by pblk, as in the index.
+ */
+static errcode_t find_shared(struct move_engine *me, struct extent_rec *recs, __u64 n) {
+    blk64_t end = 0;
+    __u64 i, j, owner = 0;
+    errcode_t retval;
+
+    if (n && (retval = spill_get_arrayzero(sizeof(ext2_ino_t), n, &me->shared)))
+        return retval;
+
+    for (i = 0; i < n; i++) {
+        if (recs[i].pblk < end && recs[i].ino != recs[owner].ino) {
+            me->shared[me->nshared++] = recs[owner].ino;
+            me->shared[me->nshared++] = recs[i].ino;
+        }
+        if (recs[i].pblk + recs[i].len > end) {
+            end = recs[i].pblk + recs[i].len;
+            owner = i;
+        }
+    }
+    qsort(me->shared, me->nshared, sizeof(ext2_ino_t), ino_cmp);
+    for (i = j = 0; i < me->nshared; i++)
+        if (j == 0 || me->shared[j - 1] != me->shared[i])
+            me->shared[j++] = me->shared[i];
+    me->nshared = j;
 
     return 0;
 }
 
-static int find_inode_by_block(e2_blkcnt_t block, struct ext2_inode *found, ext2_ino_t *ino) {
-    struct inode_search_context ctx = {0};
-    ctx.block = block;
+/*
+ * 从 goal 起找第一段至少 `len` 块的空闲区, wrapping to the offset once.
+ * Only MOVE_EXTENT_SCAN free extents are looked at, a file that does not
+ * fit in them is split as before.
+ */
+static int find_extent(struct move_engine *me, blk64_t goal, __u64 len, blk64_t *ret) {
+    blk64_t last = ext2fs_blocks_count(fs->super) - 1, s = goal, start, end;
+    int i, wrapped = goal <= me->offset;
 
-    for (*ino = EXT2_ROOT_INO; *ino < fs->super->s_inodes_count; (*ino)++) {
-        if (ext2fs_read_inode(fs, *ino, found))
+    for (i = 0; i < MOVE_EXTENT_SCAN; i++) {
+        if (s > last || ext2fs_find_first_zero_block_bitmap2(me->alloc_map, s, last, &start)) {
+            if (wrapped)
+                return 0;
+            wrapped = 1;
+            s = me->offset;
             continue;
+        }
+        if (ext2fs_find_first_set_block_bitmap2(me->alloc_map, start, last, &end))
+            end = last + 1;
+        if (end - start >= len) {
+            *ret = start;
+            return 1;
+        }
+        s = end;
+    }
+    return 0;
+}
+
+/* inode所在(flex)组的第一个块, 在低区内时为0 */
+static blk64_t group_goal(struct move_engine *me, ext2_ino_t ino) {
+    dgrp_t g = ext2fs_group_of_ino(fs, ino);
+    blk64_t goal;
+
+    if (ext2fs_has_feature_flex_bg(fs->super) && fs->super->s_log_groups_per_flex)
+        g &= ~((1U << fs->super->s_log_groups_per_flex) - 1);
+    goal = ext2fs_group_first_block2(fs, g);
+    return goal >= me->offset ? goal : 0;
+}
+
+static errcode_t plan_inode(struct move_engine *me, struct extent_rec *rec, int count) {
+    struct move_inode *mi;
+    errcode_t retval;
+    blk64_t s, e, b;
+    __u64 need = 0;
+    int i;
+
+    if (me->ninodes == me->inodes_size) {
+        __u64 size = me->inodes_size ? me->inodes_size * 2 : 256;
+        if (retval = spill_resize_array(sizeof(struct move_inode), me->inodes_size, size, &me->inodes))
+            return retval;
+        me->inodes_size = size;
+    }
+    mi = me->inodes + me->ninodes;
+    memset(mi, 0, sizeof(*mi));
+    mi->ino = rec->ino;
+    mi->first = me->ntasks;
+    mi->deferred = me->nshared && bsearch(&mi->ino, me->shared, me->nshared, sizeof(ext2_ino_t), ino_cmp);
+
+    /* 整个文件放进一段空闲区 */
+    if (move_locality) {
+        for (i = 0; i < count; i++)
+            if (rec[i].pblk < me->offset)
+                need += (rec[i].pblk + rec[i].len < me->offset ? rec[i].pblk + rec[i].len : me->offset) - rec[i].pblk;
+        if (need && find_extent(me, me->cursor, need, &b)) {
+            me->cursor = b;
+            me->contiguous++;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        s = rec[i].pblk;
+        e = rec[i].pblk + rec[i].len;
+        if (e > me->offset)
+            e = me->offset;
 
-        // printf("%s", found->);
-        // 循环inode所有blocks
-        ext2fs_block_iterate3(fs, *ino, BLOCK_FLAG_READ_ONLY, NULL, inode_blocks_proc, &ctx);
-        if (ctx.ret) {
-            return 0;
+        /* 共享块只拷贝一次 */
+        while (s < e) {
+            if (ext2fs_test_block_bitmap2(me->planned, s)) {
+                if (ext2fs_find_first_zero_block_bitmap2(me->planned, s, e - 1, &b))
+                    b = e;
+                s = b;
+                continue;
+            }
+            if (ext2fs_find_first_set_block_bitmap2(me->planned, s, e - 1, &b))
+                b = e;
+            ext2fs_mark_block_bitmap_range2(me->planned, s, b - s);
+            if (retval = plan_run(me, s, rec[i].lblk + (s - rec[i].pblk), b - s, rec[i].flags))
+                return retval;
+            s = b;
         }
     }
 
-    return 1;
+    mi->ntasks = me->ntasks - mi->first;
+    me->ninodes++;
+    return 0;
 }
 
-struct process_block_context {
+struct plan_order {
+    __u64 first;    // first record of the inode
+    __u64 count;
+    ext2_ino_t key; // directory the inode is planned with
     ext2_ino_t ino;
-    struct ext2_inode *inode;
-    ext2fs_block_bitmap reserve;
-    ext2fs_block_bitmap alloc_map;
-    errcode_t error;
-    char *buf;
-    int add_dir;
-    int flags;
+    int dir;
 };
 
-static int process_and_move_block(ext2_filsys fs,
-                                  blk64_t *block_nr,
-                                  e2_blkcnt_t blockcnt,
-                                  blk64_t ref_block,
-                                  int ref_offset,
-                                  void *priv_data) {
-    struct process_block_context *pb;
+/* 目录在前, 紧跟它的文件 */
+static int plan_order_cmp(const void *a, const void *b) {
+    const struct plan_order *pa = a, *pb = b;
+
+    if (pa->key != pb->key)
+        return pa->key < pb->key ? -1 : 1;
+    if (pa->dir != pb->dir)
+        return pa->dir ? -1 : 1;
+    return pa->ino < pb->ino ? -1 : pa->ino > pb->ino;
+}
+
+/*
+ * 按目录顺序规划 `recs` (sorted by move_rec_cmp). The cursor jumps to the
+ * goal of a directory only when it changes (flex) group, so the
+ * directories of one group are packed one after another.
+ */
+static errcode_t plan_locality(struct move_engine *me, struct extent_rec *recs, __u64 n) {
+    struct plan_order *order = NULL, *o;
+    __u64 i, b, norder = 0;
+    ext2_ino_t key = 0;
+    blk64_t goal;
     errcode_t retval;
-    int ret;
-    blk64_t block, orig;
 
-    pb = (struct process_block_context *)priv_data;
-    block = orig = *block_nr;
-    ret = 0;
+    if (retval = extent_index_parents(fs, fs_index))
+        return retval;
+    if (n && (retval = spill_get_arrayzero(sizeof(struct plan_order), n, &order)))
+        return retval;
 
-    /*
-     * Let's see if this is one which we need to relocate
-     */
-    if (ext2fs_test_block_bitmap2(pb->reserve, block)) {
-        // TODO 确保node所有的block连续
-        do {
-            if (++block >= ext2fs_blocks_count(fs->super))
-                block = fs->super->s_first_data_block;
-
-            if (block == orig) {
-                retval = EXT2_ET_BLOCK_ALLOC_FAIL;
-                goto _exit;
+    for (i = 0; i < n; i = b) {
+        for (b = i + 1; b < n && recs[b].ino == recs[i].ino; b++)
+            ;
+        o = order + norder++;
+        o->first = i;
+        o->count = b - i;
+        o->ino = recs[i].ino;
+        o->dir = !!(recs[i].flags & EREC_DIR);
+        o->key = o->ino;
+        if (!o->dir && o->ino <= fs_index->inodes && fs_index->parent[o->ino])
+            o->key = fs_index->parent[o->ino];
+    }
+    qsort(order, norder, sizeof(struct plan_order), plan_order_cmp);
+
+    for (i = 0; i < norder; i++) {
+        o = order + i;
+        if (i == 0 || o->key != key) {
+            key = o->key;
+            goal = group_goal(me, key);
+            if (goal && goal != me->goal)
+                me->cursor = goal;
+            me->goal = goal;
+        }
+        if (retval = plan_inode(me, recs + o->first, o->count))
+            break;
+    }
+
+    spill_free(&order);
+    return retval;
+}
+
+static errcode_t plan_move(struct move_engine *me) {
+    struct extent_rec *recs = NULL, *r;
+    blk64_t first = fs->super->s_first_data_block, b;
+    __u64 i, n = 0, counts[BCLASS_MAX] = {0};
+    errcode_t retval;
+
+    /* 从扫描缓存启动时位图尚未读取 */
+    if (retval = bitmaps_load(fs, move_threads, NULL))
+        return retval;
+    if (retval = fs_index_load(fs))
+        return retval;
+
+    if (retval = ext2fs_copy_bitmap(fs->block_map, &me->alloc_map))
+        return retval;
+    if (retval = ext2fs_allocate_block_bitmap(fs, "planned blocks", &me->planned))
+        return retval;
+    ext2fs_mark_block_bitmap_range2(me->alloc_map, first, me->offset - first);
+    me->cursor = me->offset;
+
+    /* 低区内的记录, 按inode分组 */
+    for (i = extent_index_find(fs_index, first); i < fs_index->count; i++) {
+        if (fs_index->recs[i].pblk >= me->offset)
+            break;
+        n++;
+    }
+    if (n && (retval = spill_get_arrayzero(sizeof(struct extent_rec), n, &recs)))
+        return retval;
+    n = 0;
+    for (i = extent_index_find(fs_index, first); i < fs_index->count; i++) {
+        r = fs_index->recs + i;
+        if (r->pblk >= me->offset)
+            break;
+        if (r->pblk + r->len <= first)
+            continue;
+        if (r->flags & EREC_RSV)
+            continue;
+        recs[n++] = *r;
+    }
+    if (retval = find_shared(me, recs, n))
+        goto _free;
+    qsort(recs, n, sizeof(struct extent_rec), move_rec_cmp);
+
+    if (move_locality) {
+        if (retval = plan_locality(me, recs, n))
+            goto _free;
+    } else {
+        for (i = 0; i < n; i = b) {
+            for (b = i + 1; b < n && recs[b].ino == recs[i].ino; b++)
+                ;
+            if (retval = plan_inode(me, recs + i, b - i))
+                goto _free;
+        }
+    }
+
+    /* task->mi 暂存的是下标 */
+    for (i = 0; i < me->ntasks; i++) {
+        me->tasks[i].mi = me->inodes + (uintptr_t)me->tasks[i].mi;
+        me->tasks[i].mi->pending++;
+    }
+    if (me->ntasks && (retval = spill_get_arrayzero(sizeof(struct move_task *), me->ntasks, &me->reloc)))
+        goto _free;
+    for (i = 0; i < me->ntasks; i++)
+        me->reloc[i] = me->tasks + i;
+    qsort(me->reloc, me->ntasks, sizeof(struct move_task *), move_task_src_cmp);
+
+    /* 不能移动的块: 静态元数据和保留inode, 从分类图统计而不是逐块检查 */
+    if (!fs_classes && (retval = class_map_build(fs, fs_index, &fs_classes)))
+        goto _free;
+    class_map_count(fs_classes, first, me->offset, counts);
+    me->pinned = counts[BCLASS_SUPER] + counts[BCLASS_BITMAP] + counts[BCLASS_ITABLE] + counts[BCLASS_JOURNAL]
+                + counts[BCLASS_RESERVED];
+
+_free:
+    spill_free(&recs);
+    return retval;
+}
+
+/*
+ * 估算清空 [first_data_block, offset) 的代价, 不做规划.
+ * Uses the same rules as plan_move (static metadata and reserved inodes are
+ * pinned, everything else is moved) but only counts, so it answers in
+ * O(log n) plus the records of the region. Only the given maps are used,
+ * so it also works on filesystems other than the global one (fleet.c).
+ */
+errcode_t move_estimate_fs(ext2_filsys fs, struct extent_index *idx, struct density_map *dm,
+                           struct class_map *cm, blk64_t offset, struct move_estimate *est) {
+    blk64_t first = fs->super->s_first_data_block, blocks = ext2fs_blocks_count(fs->super);
+    __u64 counts[BCLASS_MAX] = {0}, used;
+    struct index_owner *owners = NULL;
+    errcode_t retval;
+    int i, n;
+
+    if (offset <= first || offset > blocks)
+        return EXT2_ET_INVALID_ARGUMENT;
+
+    memset(est, 0, sizeof(struct move_estimate));
+    used = density_count(dm, fs->block_map, first, offset);
+    class_map_count(cm, first, offset, counts);
+    est->pinned = counts[BCLASS_SUPER] + counts[BCLASS_BITMAP] + counts[BCLASS_ITABLE] + counts[BCLASS_JOURNAL]
+                + counts[BCLASS_RESERVED];
+    est->blocks = used > est->pinned ? used - est->pinned : 0;
+    est->free = (blocks - offset) - density_count(dm, fs->block_map, offset, blocks);
+
+    if (retval = extent_index_owners(idx, first, offset, &owners, &n))
+        return retval;
+    for (i = 0; i < n; i++)
+        if (!(owners[i].flags & EREC_RSV))
+            est->inodes++;
+    ext2fs_free_mem(&owners);
+
+    return 0;
+}
+
+errcode_t move_estimate(blk64_t offset, struct move_estimate *est) {
+    errcode_t retval;
+
+    if (retval = bitmaps_load(fs, move_threads, NULL))
+        return retval;
+    if (!fs_density && (retval = density_build(fs, fs->block_map, move_threads, &fs_density)))
+        return retval;
+    if (retval = fs_index_load(fs))
+        return retval;
+    if (!fs_classes && (retval = class_map_build(fs, fs_index, &fs_classes)))
+        return retval;
+
+    return move_estimate_fs(fs, fs_index, fs_density, fs_classes, offset, est);
+}
+
+static void free_engine(struct move_engine *me) {
+    if (me->alloc_map)
+        ext2fs_free_block_bitmap(me->alloc_map);
+    if (me->planned)
+        ext2fs_free_block_bitmap(me->planned);
+    spill_free(&me->tasks);
+    spill_free(&me->reloc);
+    spill_free(&me->inodes);
+    spill_free(&me->shared);
+}
+
+static struct move_task *find_reloc(struct move_engine *me, blk64_t blk) {
+    __u64 lo = 0, hi = me->ntasks, mid;
+    struct move_task *t;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        t = me->reloc[mid];
+        if (blk < t->src)
+            hi = mid;
+        else if (blk >= t->src + t->len)
+            lo = mid + 1;
+        else
+            return t;
+    }
+
+    return NULL;
+}
+
+static void queue_commit(struct move_engine *me, struct move_inode *mi) {
+    mi->next = NULL;
+    if (me->commit_tail)
+        me->commit_tail->next = mi;
+    else
+        me->commit_head = mi;
+    me->commit_tail = mi;
+    pthread_cond_broadcast(&me->cond);
+}
+
+/* 调用时持有 me->lock */
+static void task_done(struct move_engine *me, struct move_task *t, errcode_t retval) {
+    if (retval) {
+        t->mi->error = retval;
+        me->error = retval;
+        me->abort = 1;
+    }
+    if (--t->mi->pending == 0 && !t->mi->error && !t->mi->deferred)
+        queue_commit(me, t->mi);
+}
+
+static void queue_verify(struct move_engine *me, struct move_task *t) {
+    t->vnext = NULL;
+    if (me->verify_tail)
+        me->verify_tail->vnext = t;
+    else
+        me->verify_head = t;
+    me->verify_tail = t;
+    pthread_cond_broadcast(&me->cond);
+}
+
+/*
+ * 目标数据落盘后才能提交: the committer frees (and with -d discards) the
+ * source blocks, so a crash must never find new block pointers in front
+ * of data still in the page cache.
+ */
+static errcode_t sync_tasks(struct move_engine *me, struct copy_channel *cc, struct move_task **head, int *count) {
+    struct move_task *t;
+    errcode_t retval;
+    __u64 ts = trace_now();
+
+    retval = copy_sync(cc);
+    trace_span("move", "fsync", ts, "\"tasks\":%d", *count);
+
+    pthread_mutex_lock(&me->lock);
+    while (t = *head) {
+        *head = t->vnext;
+        task_done(me, t, retval);
+    }
+    pthread_mutex_unlock(&me->lock);
+    *count = 0;
+    return retval;
+}
+
+static void move_throttle(struct move_engine *me, __u64 bytes, __u32 ios) {
+    __u64 ts = trace_now();
+
+    rate_limit_wait(&me->rate, bytes, ios);
+    if (trace_file && trace_now() - ts >= 1000)
+        trace_span("move", "throttle", ts, NULL);
+}
+
+/*
+ * 限速或设置了I/O优先级时每个任务的写入都等设备完成: a buffered pwrite
+ * only dirties the page cache, writeback would then reach the device at
+ * full speed and without the worker's priority. The write tokens are
+ * taken right before the writeback.
+ */
+static errcode_t move_write_back(struct move_engine *me, struct copy_channel *cc, struct move_task *t) {
+    __u64 bytes_rate, iops_rate;
+
+    rate_limit_get(&me->rate, &bytes_rate, &iops_rate);
+    if (!bytes_rate && !iops_rate && io_priority < 0)
+        return 0;
+    move_throttle(me, (__u64)t->len * fs->blocksize, 1);
+    return copy_flush(cc, t->dst, t->len);
+}
+
+static void *thread_copy(void *arg) {
+    struct move_engine *me = (struct move_engine *)arg;
+    struct copy_channel *cc = NULL;
+    struct move_task *t, *unsynced = NULL;
+    errcode_t retval;
+    char *buf = NULL;
+    int nunsynced = 0;
+    __u64 ts;
+
+    trace_thread_name("copy worker");
+    if (io_priority >= 0 && (retval = set_thread_ioprio(io_priority)))
+        goto _exit;
+    if (retval = copy_open(device_name, fs->blocksize, (fs->flags & EXT2_FLAG_DIRECT_IO) ? COPY_DIRECT : 0, &cc))
+        goto _exit;
+    buf = buf_pool_get();
+
+    for (;;) {
+        pthread_mutex_lock(&me->lock);
+        if (me->abort || me->next_task >= me->ntasks) {
+            pthread_mutex_unlock(&me->lock);
+            break;
+        }
+        t = me->tasks + me->next_task++;
+        pthread_mutex_unlock(&me->lock);
+
+        /* 未初始化的extent内容恒为0, 只需修改元数据 */
+        if (t->flags & EREC_UNINIT) {
+            pthread_mutex_lock(&me->lock);
+            me->skipped += t->len;
+            task_done(me, t, 0);
+            pthread_mutex_unlock(&me->lock);
+            continue;
+        }
+
+        /* 全0检测需要读出数据, 不能卸载 */
+        if (!move_zero && (cc->flags & (COPY_CLONE | COPY_RANGE))) {
+            int cloned;
+
+            ts = trace_now();
+            retval = copy_offload(cc, t->src, t->dst, t->len, &cloned);
+            if (retval != EXT2_ET_UNIMPLEMENTED) {
+                /* reflink不搬数据; 内核拷贝仍是一次读加一次写 */
+                if (!retval && !cloned) {
+                    move_throttle(me, (__u64)t->len * fs->blocksize, 1);
+                    retval = move_write_back(me, cc, t);
+                }
+                trace_span("move", cloned ? "reflink" : "copy_file_range", ts,
+                           "\"ino\":%u,\"src\":%llu,\"dst\":%llu,\"len\":%u",
+                           t->mi->ino, t->src, t->dst, t->len);
+                t->offloaded = 1;
+                pthread_mutex_lock(&me->lock);
+                me->copied += t->len;
+                if (cloned)
+                    me->cloned += t->len;
+                else
+                    me->offloaded += t->len;
+                if (move_verify && !retval)
+                    queue_verify(me, t);
+                else if (retval)
+                    task_done(me, t, retval);
+                else {
+                    t->vnext = unsynced;
+                    unsynced = t;
+                    nunsynced++;
+                }
+                pthread_mutex_unlock(&me->lock);
+                if (nunsynced >= MOVE_SYNC_TASKS)
+                    sync_tasks(me, cc, &unsynced, &nunsynced);
+                continue;
             }
-        } while (ext2fs_test_block_bitmap2(pb->reserve, block) || ext2fs_test_block_bitmap2(pb->alloc_map, block));
+        }
 
-        if (retval = io_channel_read_blk64(fs->io, orig, 1, pb->buf))
-            goto _exit;
+        move_throttle(me, (__u64)t->len * fs->blocksize, 1);
+        ts = trace_now();
+        if (!(retval = copy_read(cc, t->src, t->len, buf))) {
+            if (move_zero && !(t->flags & (EREC_META | EREC_DIR))
+                && copy_is_zero(buf, (size_t)t->len * fs->blocksize))
+                t->zero = 1;
 
-        if (retval = io_channel_write_blk64(fs->io, block, 1, pb->buf))
-            goto _exit;
+            if (t->zero && (t->flags & EREC_EXTENT))
+                ; /* 提交时映射为unwritten extent */
+            else if (t->zero)
+                retval = copy_zeroout(cc, t->dst, t->len);
+            else {
+                if (move_verify)
+                    t->crc = copy_crc32c(~0U, buf, (size_t)t->len * fs->blocksize);
+                retval = copy_write(cc, t->dst, t->len, buf);
+            }
+            if (!retval && !(t->zero && (t->flags & EREC_EXTENT)))
+                retval = move_write_back(me, cc, t);
+        }
+        trace_span("move", t->zero ? "zero" : "copy", ts,
+                   "\"ino\":%u,\"src\":%llu,\"dst\":%llu,\"len\":%u",
+                   t->mi->ino, t->src, t->dst, t->len);
+
+        pthread_mutex_lock(&me->lock);
+        if (t->zero)
+            me->skipped += t->len;
+        else
+            me->copied += t->len;
+        if (move_verify && !retval && !t->zero)
+            queue_verify(me, t);
+        else if (retval || (t->zero && (t->flags & EREC_EXTENT)))
+            task_done(me, t, retval);
+        else {
+            t->vnext = unsynced;
+            unsynced = t;
+            nunsynced++;
+        }
+        pthread_mutex_unlock(&me->lock);
+        if (nunsynced >= MOVE_SYNC_TASKS)
+            sync_tasks(me, cc, &unsynced, &nunsynced);
+    }
 
-        *block_nr = block;
-        ext2fs_mark_block_bitmap2(pb->alloc_map, block);
-        ret = BLOCK_CHANGED;
+    retval = sync_tasks(me, cc, &unsynced, &nunsynced);
 
-        if (pb->flags & FLAGS_DEBUG)
-            printf("ino=%u, blockcnt=%lld, %llu->%llu\n",
-                   (unsigned)pb->ino, blockcnt,
-                   (unsigned long long)orig,
-                   (unsigned long long)block);
+_exit:
+    pthread_mutex_lock(&me->lock);
+    if (retval && !me->error) {
+        me->error = retval;
+        me->abort = 1;
     }
-    if (pb->add_dir) {
-        if (retval = ext2fs_add_dir_block2(fs->dblist, pb->ino, block, blockcnt))
+    me->running--;
+    pthread_cond_broadcast(&me->cond);
+    pthread_mutex_unlock(&me->lock);
+
+    buf_pool_put(buf);
+    copy_close(cc);
+    return NULL;
+}
+
+/*
+ * 校验线程: re-read the destination of copied tasks in batches and compare
+ * with the crc32c taken from the source buffer. An inode is only handed to
+ * the committer once all its tasks are verified, so a bad copy never gets
+ * referenced by the filesystem.
+ */
+static void *thread_verify(void *arg) {
+    struct move_engine *me = (struct move_engine *)arg;
+    struct copy_channel *cc = NULL;
+    struct move_task *batch, *t;
+    errcode_t retval;
+    char *buf = NULL;
+    __u32 crc, n;
+    __u64 ts;
+
+    trace_thread_name("verifier");
+    if (io_priority >= 0 && (retval = set_thread_ioprio(io_priority)))
+        goto _exit;
+    if (retval = copy_open(device_name, fs->blocksize, (fs->flags & EXT2_FLAG_DIRECT_IO) ? COPY_DIRECT : 0, &cc))
+        goto _exit;
+    buf = buf_pool_get();
+
+    for (;;) {
+        pthread_mutex_lock(&me->lock);
+        while (!me->verify_head && me->running)
+            pthread_cond_wait(&me->cond, &me->lock);
+        batch = me->verify_head;
+        me->verify_head = me->verify_tail = NULL;
+        pthread_mutex_unlock(&me->lock);
+
+        if (!batch)
+            break;
+
+        /* 先落盘再丢弃页缓存, 保证读到的是设备上的数据 */
+        ts = trace_now();
+        if (retval = copy_sync(cc))
             goto _exit;
+        trace_span("verify", "fsync", ts, NULL);
+
+        for (ts = trace_now(), n = 0; batch; n++) {
+            t = batch;
+            batch = t->vnext;
+            retval = 0;
+
+            /* 内核拷贝的任务没有源数据的crc, 从源块补算 */
+            if (t->offloaded) {
+                move_throttle(me, (__u64)t->len * fs->blocksize, 1);
+                if (!(retval = copy_read(cc, t->src, t->len, buf)))
+                    t->crc = copy_crc32c(~0U, buf, (size_t)t->len * fs->blocksize);
+            }
+
+            move_throttle(me, (__u64)t->len * fs->blocksize, 1);
+            copy_drop_cache(cc, t->dst, t->len);
+            if (!retval && !(retval = copy_read(cc, t->dst, t->len, buf))) {
+                crc = copy_crc32c(~0U, buf, (size_t)t->len * fs->blocksize);
+                if (crc != t->crc)
+                    retval = EXT2_ET_BAD_CRC;
+            }
+
+            pthread_mutex_lock(&me->lock);
+            me->verified += t->len;
+            task_done(me, t, retval);
+            pthread_mutex_unlock(&me->lock);
+        }
+        trace_span("verify", "verify_batch", ts, "\"tasks\":%u", n);
+        retval = 0;
     }
 
 _exit:
-    pb->error = retval;
+    pthread_mutex_lock(&me->lock);
+    if (retval && !me->error) {
+        me->error = retval;
+        me->abort = 1;
+    }
+    /* 出错时剩下的任务也不能提交 */
+    for (t = me->verify_head; t; t = t->vnext)
+        task_done(me, t, retval ? retval : EXT2_ET_BAD_CRC);
+    me->verify_head = me->verify_tail = NULL;
+    me->verifying = 0;
+    pthread_cond_broadcast(&me->cond);
+    pthread_mutex_unlock(&me->lock);
 
-    return ret | BLOCK_ABORT;
+    buf_pool_put(buf);
+    copy_close(cc);
+    return NULL;
 }
 
-static int move_inode(ext2_ino_t ino, struct ext2_inode *inode, __u64 after_block) {
+struct commit_context {
+    struct move_engine *me;
+    int changed;
+};
+
+static int commit_block_proc(ext2_filsys fs EXT2FS_ATTR((unused)),
+                             blk64_t *block_nr,
+                             e2_blkcnt_t blockcnt EXT2FS_ATTR((unused)),
+                             blk64_t ref_block EXT2FS_ATTR((unused)),
+                             int ref_offset EXT2FS_ATTR((unused)),
+                             void *priv_data) {
+    struct commit_context *ctx = (struct commit_context *)priv_data;
+    struct move_task *t;
+
+    if (*block_nr >= ctx->me->offset)
+        return 0;
+    if (!(t = find_reloc(ctx->me, *block_nr)))
+        return 0;
+    /* 全0段留在源块 (内容同样是0), 之后再映射为unwritten */
+    if (t->zero && (t->flags & EREC_EXTENT))
+        return 0;
+
+    *block_nr = t->dst + (*block_nr - t->src);
+    ctx->changed++;
+    return BLOCK_CHANGED;
+}
+
+/* 新的extent树块不能落在低区或已预留的目标块上 */
+static struct move_engine *alloc_engine;
+
+static errcode_t move_get_alloc_block(ext2_filsys fs, blk64_t goal, blk64_t *ret) {
+    struct move_engine *me = alloc_engine;
+    blk64_t last = ext2fs_blocks_count(fs->super) - 1;
+
+    if (goal < me->offset || goal > last)
+        goal = me->offset;
+    if (ext2fs_find_first_zero_block_bitmap2(me->alloc_map, goal, last, ret)
+        && ext2fs_find_first_zero_block_bitmap2(me->alloc_map, me->offset, last, ret))
+        return EXT2_ET_BLOCK_ALLOC_FAIL;
+
+    /* 空闲计数由ext2fs_alloc_block3更新, 这里只标记位图 */
+    ext2fs_mark_block_bitmap2(me->alloc_map, *ret);
+    ext2fs_mark_block_bitmap2(fs->block_map, *ret);
+    ext2fs_mark_bb_dirty(fs);
+    return 0;
+}
+
+static errcode_t commit_inode(struct move_engine *me, struct move_inode *mi, char *block_buf) {
+    struct commit_context ctx = {me, 0};
+    struct ext2_inode inode;
+    struct move_task *t;
     errcode_t retval;
-    struct process_block_context pb;
-    char *block_buf;
+    blk64_t blk;
+
+    if (retval = ext2fs_read_inode(fs, mi->ino, &inode))
+        return retval;
 
-    pb.reserve = fs->block_map;
-    pb.error = 0;
-    pb.alloc_map = NULL;
-    pb.flags = 0;
+    if (ext2fs_inode_has_valid_blocks2(fs, &inode)) {
+        if (retval = ext2fs_block_iterate3(fs, mi->ino, 0, block_buf, commit_block_proc, &ctx))
+            return retval;
+        if (retval = ext2fs_read_inode(fs, mi->ino, &inode))
+            return retval;
+    }
 
-    ext2fs_copy_bitmap(fs->block_map, &pb.alloc_map);
-    while (after_block > 0)
-        ext2fs_mark_block_bitmap2(pb.alloc_map, after_block--);
+    /*
+     * 全0的数据直接映射为unwritten extent, on the tree the remap above has
+     * already moved to its destination. Until then the runs still point at
+     * their all-zero source blocks, so the file never maps the unwritten
+     * destination as initialized.
+     */
+    if (inode.i_flags & EXT4_EXTENTS_FL) {
+        ext2_extent_handle_t handle = NULL;
+        __u32 i;
 
-    if (retval = ext2fs_get_array(4, fs->blocksize, &block_buf))
-        goto _done;
+        for (t = me->tasks + mi->first; t < me->tasks + mi->first + mi->ntasks; t++) {
+            if (!t->zero || !(t->flags & EREC_EXTENT))
+                continue;
+            if (!handle && (retval = ext2fs_extent_open2(fs, mi->ino, &inode, &handle)))
+                return retval;
+            for (i = 0; i < t->len; i++)
+                if (retval = ext2fs_extent_set_bmap(handle, t->lblk + i, t->dst + i, EXT2_EXTENT_SET_BMAP_UNINIT))
+                    break;
+            if (retval)
+                break;
+        }
+        if (handle) {
+            ext2fs_extent_free(handle);
+            if (retval)
+                return retval;
+            if (retval = ext2fs_read_inode(fs, mi->ino, &inode))
+                return retval;
+        }
+    }
 
-    pb.buf = block_buf + fs->blocksize * 3;
+    blk = ext2fs_file_acl_block(fs, &inode);
+    if (blk && blk < me->offset && (t = find_reloc(me, blk))) {
+        ext2fs_file_acl_block_set(fs, &inode, t->dst + (blk - t->src));
+        if (retval = ext2fs_write_inode(fs, mi->ino, &inode))
+            return retval;
+    }
 
-    if ((inode->i_links_count == 0) || !ext2fs_inode_has_valid_blocks2(fs, inode))
-        goto _done;
+    /*
+     * 位图: 目标块占用, 源块释放.
+     * Shared source blocks are only released once every deferred inode
+     * has been committed, see release_deferred().
+     */
+    for (t = me->tasks + mi->first; t < me->tasks + mi->first + mi->ntasks; t++) {
+        ext2fs_block_alloc_stats_range(fs, t->dst, t->len, +1);
+        if (!mi->deferred)
+            ext2fs_block_alloc_stats_range(fs, t->src, t->len, -1);
+        me->moved += t->len;
+    }
+    mi->committed = 1;
 
-    pb.ino = ino;
-    pb.inode = inode;
+    return 0;
+}
 
-    pb.add_dir = LINUX_S_ISDIR(inode->i_mode) && fs->dblist;
+static void release_deferred(struct move_engine *me) {
+    struct move_inode *mi;
+    struct move_task *t;
 
-    retval = ext2fs_block_iterate3(fs, ino, 0, block_buf, process_and_move_block, &pb);
-    if (retval)
-        goto _done;
+    for (mi = me->inodes; mi < me->inodes + me->ninodes; mi++) {
+        if (!mi->deferred)
+            continue;
+        for (t = me->tasks + mi->first; t < me->tasks + mi->first + mi->ntasks; t++)
+            ext2fs_block_alloc_stats_range(fs, t->src, t->len, -1);
+    }
+    me->released = 1;
+}
 
-    if (retval = pb.error)
-        goto _done;
+/*
+ * 释放的源块发送discard (BLKDISCARD / FALLOC_FL_PUNCH_HOLE), merged into
+ * large ranges. Only called after the metadata is flushed, so nothing on
+ * disk still points at them.
+ */
+static errcode_t discard_sources(struct move_engine *me) {
+    blk64_t start = 0, end = 0;
+    struct move_task *t;
+    errcode_t retval = 0;
+    __u64 i;
 
-_done:
+    for (i = 0; i <= me->ntasks && !retval; i++) {
+        t = i < me->ntasks ? me->reloc[i] : NULL;
+        if (t && (!t->mi->committed || (t->mi->deferred && !me->released)))
+            continue;
+        if (t && t->src <= end && end > start) {
+            if (t->src + t->len > end)
+                end = t->src + t->len;
+            continue;
+        }
+        if (end > start) {
+            retval = io_channel_discard(fs->io, start, end - start);
+            if (!retval) {
+                pthread_mutex_lock(&me->lock);
+                me->discarded += end - start;
+                pthread_mutex_unlock(&me->lock);
+            }
+        }
+        if (t) {
+            start = t->src;
+            end = t->src + t->len;
+        }
+    }
+
+    /* 设备不支持discard不算错误 */
+    if (retval == EXT2_ET_UNIMPLEMENTED || retval == EOPNOTSUPP)
+        retval = 0;
+    return retval;
+}
+
+static void *thread_commit(void *arg) {
+    struct move_engine *me = (struct move_engine *)arg;
+    struct move_inode *mi;
+    errcode_t retval = 0;
+    char *block_buf = NULL;
+    __u64 i, ts;
+
+    trace_thread_name("committer");
+    if (io_priority >= 0 && (retval = set_thread_ioprio(io_priority)))
+        goto _error;
+    if (retval = ext2fs_get_array(3, fs->blocksize, &block_buf))
+        goto _error;
+
+    for (;;) {
+        pthread_mutex_lock(&me->lock);
+        while (!me->commit_head && (me->running || me->verifying))
+            pthread_cond_wait(&me->cond, &me->lock);
+        mi = me->commit_head;
+        if (mi) {
+            me->commit_head = mi->next;
+            if (!me->commit_head)
+                me->commit_tail = NULL;
+        }
+        pthread_mutex_unlock(&me->lock);
+
+        if (!mi)
+            break;
+        ts = trace_now();
+        if (retval = commit_inode(me, mi, block_buf))
+            goto _error;
+        trace_span("commit", "commit_inode", ts, "\"ino\":%u,\"tasks\":%u", mi->ino, mi->ntasks);
+
+        pthread_mutex_lock(&me->lock);
+        me->committed++;
+        pthread_mutex_unlock(&me->lock);
+    }
+
+    /* 共享块的inode在所有拷贝完成后提交 */
+    for (i = 0; i < me->ninodes && !me->abort; i++) {
+        mi = me->inodes + i;
+        if (!mi->deferred || mi->pending || mi->error)
+            continue;
+        ts = trace_now();
+        if (retval = commit_inode(me, mi, block_buf))
+            goto _error;
+        trace_span("commit", "commit_deferred", ts, "\"ino\":%u,\"tasks\":%u", mi->ino, mi->ntasks);
+        pthread_mutex_lock(&me->lock);
+        me->committed++;
+        pthread_mutex_unlock(&me->lock);
+    }
+    if (!me->abort)
+        release_deferred(me);
+
+    ts = trace_now();
+    if (retval = ext2fs_flush(fs))
+        goto _error;
+    trace_span("commit", "ext2fs_flush", ts, NULL);
+    if (move_discard) {
+        ts = trace_now();
+        me->discard_error = discard_sources(me);
+        trace_span("commit", "discard", ts, "\"blocks\":%llu", (unsigned long long)me->discarded);
+    }
+
+_error:
+    pthread_mutex_lock(&me->lock);
+    if (retval) {
+        me->error = retval;
+        me->abort = 1;
+    }
+    pthread_mutex_unlock(&me->lock);
     ext2fs_free_mem(&block_buf);
-    ext2fs_free_block_bitmap(pb.alloc_map);
+    return NULL;
+}
+
+static errcode_t run_engine(struct move_engine *me, WINDOW *win) {
+    errcode_t (*old_alloc)(ext2_filsys fs, blk64_t goal, blk64_t *ret);
+    pthread_t *workers, committer, verifier;
+    __u64 total = 0, i;
+    int nthreads = move_threads > 0 ? move_threads : 1;
+    __u64 bytes_rate, iops_rate;
+    time_t start;
+    errcode_t retval;
+    int n, verify = 0;
+
+    for (i = 0; i < me->ntasks; i++)
+        total += me->tasks[i].len;
+
+    if (retval = ext2fs_get_array(nthreads, sizeof(pthread_t), &workers))
+        return retval;
+    /* 每个拷贝线程和校验线程各一个, 会话内重复使用 */
+    if (retval = buf_pool_init(nthreads + move_verify, (size_t)MOVE_BATCH_BLOCKS * fs->blocksize)) {
+        ext2fs_free_mem(&workers);
+        return retval;
+    }
+
+    /* 工作线程绕过libext2fs的缓存直接读写设备 */
+    io_channel_flush(fs->io);
+    io_channel_set_options(fs->io, "cache=off");
+
+    alloc_engine = me;
+    ext2fs_set_alloc_block_callback(fs, move_get_alloc_block, &old_alloc);
+
+    pthread_mutex_init(&me->lock, NULL);
+    pthread_cond_init(&me->cond, NULL);
+    rate_limit_init(&me->rate, (__u64)rate_mbps << 20, rate_iops);
+    start = time(NULL);
+
+    for (n = 0; n < nthreads; n++) {
+        pthread_mutex_lock(&me->lock);
+        me->running++;
+        pthread_mutex_unlock(&me->lock);
+        if (pthread_create(&workers[n], NULL, thread_copy, me)) {
+            pthread_mutex_lock(&me->lock);
+            me->running--;
+            pthread_mutex_unlock(&me->lock);
+            break;
+        }
+    }
+    if (n && move_verify) {
+        me->verifying = 1;
+        if (pthread_create(&verifier, NULL, thread_verify, me))
+            me->verifying = 0;
+        else
+            verify = 1;
+    }
+    if (n == 0 || verify != move_verify || pthread_create(&committer, NULL, thread_commit, me)) {
+        pthread_mutex_lock(&me->lock);
+        me->abort = 1;
+        pthread_mutex_unlock(&me->lock);
+        while (n--)
+            pthread_join(workers[n], NULL);
+        if (verify)
+            pthread_join(verifier, NULL);
+        retval = EX_OSERR;
+        goto _restore;
+    }
+
+    wtimeout(win, 200);
+    for (;;) {
+        __u64 copied, skipped, verified, committed, offloaded, cloned;
+        int running, verifying;
+
+        pthread_mutex_lock(&me->lock);
+        copied = me->copied;
+        skipped = me->skipped;
+        offloaded = me->offloaded;
+        cloned = me->cloned;
+        verified = me->verified;
+        committed = me->committed;
+        running = me->running;
+        verifying = me->verifying;
+        pthread_mutex_unlock(&me->lock);
+
+        mvwprintw(win, 2, 2, "Copied    %llu/%llu blocks (%d threads), %llu skipped   ",
+                  (unsigned long long)copied, (unsigned long long)total, running, (unsigned long long)skipped);
+        mvwprintw(win, 3, 2, "Committed %llu/%llu inodes   ",
+                  (unsigned long long)committed, (unsigned long long)me->ninodes);
+        if (offloaded || cloned)
+            mvwprintw(win, 5, 2, "Offloaded %llu blocks, reflinked %llu blocks   ",
+                      (unsigned long long)offloaded, (unsigned long long)cloned);
+        if (move_verify)
+            mvwprintw(win, 4, 2, "Verified  %llu/%llu blocks   ",
+                      (unsigned long long)verified, (unsigned long long)total);
+        rate_limit_get(&me->rate, &bytes_rate, &iops_rate);
+        win_clear(win, 6, 2, 60);
+        if (bytes_rate || iops_rate)
+            mvwprintw(win, 6, 2, "Limit %.1f MB/s, %llu IOPS (+/- adjust, 0 unlimited)",
+                      bytes_rate / 1048576.0, (unsigned long long)iops_rate);
+        else
+            mvwprintw(win, 6, 2, "No rate limit (- to throttle)");
+        wrefresh(win);
+        if (!running && !verifying)
+            break;
+
+        switch (wgetch(win)) {
+        case '+':
+            rate_limit_set(&me->rate, bytes_rate * 5 / 4, iops_rate * 5 / 4);
+            break;
+        case '-':
+            /* 未限速时从当前速度开始 */
+            if (!bytes_rate && !iops_rate && time(NULL) > start)
+                bytes_rate = copied * fs->blocksize / (time(NULL) - start);
+            bytes_rate = bytes_rate * 4 / 5;
+            iops_rate = iops_rate * 4 / 5;
+            rate_limit_set(&me->rate, bytes_rate > 1048576 || !bytes_rate ? bytes_rate : 1048576,
+                           iops_rate > 10 || !iops_rate ? iops_rate : 10);
+            break;
+        case '0':
+            rate_limit_set(&me->rate, 0, 0);
+            break;
+        case 27:
+        case 'q':
+            pthread_mutex_lock(&me->lock);
+            me->abort = 1;
+            pthread_mutex_unlock(&me->lock);
+            mvwprintw(win, 7, 2, "Stopping, copies in flight are committed ...");
+            break;
+        }
+    }
+    wtimeout(win, -1);
+
+    while (n--)
+        pthread_join(workers[n], NULL);
+    if (verify)
+        pthread_join(verifier, NULL);
+    pthread_join(committer, NULL);
+    retval = me->error;
+
+_restore:
+    ext2fs_set_alloc_block_callback(fs, old_alloc, NULL);
+    alloc_engine = NULL;
+    io_channel_set_options(fs->io, "cache=on");
+    rate_limit_destroy(&me->rate);
+    pthread_cond_destroy(&me->cond);
+    pthread_mutex_destroy(&me->lock);
+    ext2fs_free_mem(&workers);
+
+    /* 区间索引, 密度和扫描缓存都已过期 */
+    cache_invalidate();
+
     return retval;
 }
 
@@ -183,9 +1253,10 @@ static int is_mounted() {
 }
 
 int do_move(WINDOW *win) {
-    __u64 blknum, tmp;
-    struct ext2_inode inode;
-    ext2_ino_t ino;
+    struct move_engine me = {0};
+    struct precheck_result pc;
+    char msg[256];
+    __u64 total = 0, i, ts;
     errcode_t retval;
     char input[16];
     int x, y, offset;
@@ -196,6 +1267,10 @@ int do_move(WINDOW *win) {
     if (retval = is_mounted()) {
         return retval;
     }
+    if (fs->flags & EXT2_FLAG_IMAGE_FILE) {
+        serr(device_name, 0, "can not move blocks inside an e2image file");
+        return EX_USAGE;
+    }
     do {
         if (retval = readline("Input the offset size.\n"
                               "size must power two or xxxB(unit blocksize).\n"
@@ -217,7 +1292,7 @@ int do_move(WINDOW *win) {
                 retval = EX_USAGE;
             } else {
                 offset = offset / block_size;
-                if (ext2fs_free_blocks_count(fs->super) * block_size < offset) {
+                if (ext2fs_free_blocks_count(fs->super) < offset) {
                     serr(device_name, 0, "does not have enough space", NULL);
                     retval = EX_DEVICE;
                 }
@@ -225,28 +1300,78 @@ int do_move(WINDOW *win) {
         }
     } while (retval);
 
-    /* */
-    for (blknum = offset; blknum > 0; blknum--) {
-        if (blknum / 1000) {
-        }
-        if (!ext2fs_test_block_bitmap2(fs->block_map, blknum))
-            continue;
+    if (offset <= fs->super->s_first_data_block)
+        return 0;
 
-        if (find_inode_by_block(blknum, &inode, &ino)) {
-            serr(prog_name, 0, "can not found inode in block %d"
-                               " quit.",
-                 blknum);
-            return EX_OSERR;
-        }
-        if (move_inode(ino, &inode, offset)) {
-            serr(prog_name, 0, "can not move inode %u in block %llu"
-                               " quit.",
-                 ino, blknum);
-            return EX_OSERR;
-        }
+    keypad(win, TRUE);
+    werase(win);
+
+    /* 只检查移动依赖的不变量, 代替完整的e2fsck */
+    mvwprintw(win, 1, 2, "Checking filesystem consistency ...");
+    wrefresh(win);
+    ts = trace_now();
+    retval = precheck_run(fs, move_threads, &pc);
+    trace_span("move", "precheck", ts, NULL);
+    if (retval) {
+        serr("precheck", retval, "while checking the filesystem");
+        return EX_OSERR;
+    }
+    if (precheck_failed(&pc)) {
+        precheck_summary(&pc, msg, sizeof(msg));
+        serr(device_name, 0, "%s. Run 'e2fsck -f %s' first", msg, device_name);
+        return EX_DEVICE;
     }
 
-    keypad(win, TRUE);
+    mvwprintw(win, 1, 2, "Planning move of blocks %u-%d ...", fs->super->s_first_data_block, offset - 1);
+    wrefresh(win);
+
+    me.offset = offset;
+    ts = trace_now();
+    retval = plan_move(&me);
+    trace_span("move", "plan_move", ts, "\"tasks\":%llu,\"inodes\":%llu",
+               (unsigned long long)me.ntasks, (unsigned long long)me.ninodes);
+    if (retval) {
+        serr("plan_move", retval, "while planning the move");
+        retval = EX_OSERR;
+        goto _free;
+    }
+    for (i = 0; i < me.ntasks; i++)
+        total += me.tasks[i].len;
+
+    mvwprintw(win, 1, 2, "%llu blocks of %llu inodes to move, %llu blocks pinned (filesystem metadata)",
+              (unsigned long long)total, (unsigned long long)me.ninodes, (unsigned long long)me.pinned);
+    if (move_locality)
+        mvwprintw(win, 2, 2, "%llu inodes placed contiguously, grouped by directory",
+                  (unsigned long long)me.contiguous);
+    mvwprintw(win, 3, 2, "Press 'y' to start, 'q' to cancel");
+    wrefresh(win);
+    for (;;) {
+        int ch = wgetch(win);
+        if (ch == 'y')
+            break;
+        if (ch == 'q' || ch == 27)
+            goto _free;
+    }
+    win_clear(win, 3, 2, x - 4);
+
+    if (retval = run_engine(&me, win)) {
+        serr(prog_name, retval, "move stopped after %llu inodes", (unsigned long long)me.committed);
+        retval = EX_OSERR;
+        goto _free;
+    }
+
+    mvwprintw(win, 7, 2, "Done: %llu blocks moved, %llu inodes updated. Press 'q' to return",
+              (unsigned long long)me.moved, (unsigned long long)me.committed);
+    if (move_discard && me.discard_error)
+        mvwprintw(win, 8, 2, "Warning: discard stopped after %llu source blocks: %s",
+                  (unsigned long long)me.discarded, error_message(me.discard_error));
+    else if (move_discard)
+        mvwprintw(win, 8, 2, "Discarded %llu source blocks", (unsigned long long)me.discarded);
+    if (sim_enabled) {
+        sim_summary(msg, sizeof(msg));
+        mvwprintw(win, 9, 2, "%.*s", x - 4, msg);
+    }
+    wrefresh(win);
     for (;;) {
         int ch = wgetch(win);
         switch (ch) {
@@ -255,5 +1380,8 @@ int do_move(WINDOW *win) {
     }
 
 _quit:
-    return 0;
+    retval = 0;
+_free:
+    free_engine(&me);
+    return retval;
 }
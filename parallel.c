@@ -0,0 +1,27 @@
+#include "e2blk.h"
+
+/*
+ * 并行执行
+ *
+ * `ctx` is an array of `nthreads` contexts of `ctx_size` bytes. proc runs
+ * on ctx[1..] in new threads and on ctx[0] in the calling thread; a
+ * context whose thread could not be created is run here as well, so the
+ * work always gets done. With a `ctx_size` of 0 all threads share one
+ * context. Returns after every context is finished.
+ */
+void run_parallel(int nthreads, void *(*proc)(void *), void *ctx, size_t ctx_size) {
+    pthread_t *threads = NULL;
+    int i, n = 1;
+
+    if (nthreads > 1 && ext2fs_get_arrayzero(nthreads, sizeof(pthread_t), &threads) == 0)
+        for (; n < nthreads; n++)
+            if (pthread_create(&threads[n], NULL, proc, (char *)ctx + (size_t)n * ctx_size))
+                break;
+
+    proc(ctx);
+    for (i = n; i < nthreads; i++)
+        proc((char *)ctx + (size_t)i * ctx_size);
+    while (--n > 0)
+        pthread_join(threads[n], NULL);
+    ext2fs_free_mem(&threads);
+}
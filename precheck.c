@@ -0,0 +1,256 @@
+#include "e2blk.h"
+
+/*
+ * 移动前的快速一致性检查
+ *
+ * Checks only the invariants a move relies on, instead of a full e2fsck:
+ *   - free block and inode counts of every group match its bitmaps,
+ *   - group descriptor and bitmap checksums,
+ *   - every run of the extent index lies inside the filesystem and is
+ *     marked used in the block bitmap,
+ *   - no block is claimed by two inodes (shared xattr blocks excepted).
+ * Groups and index records are split between `nthreads` threads, the
+ * bitmaps and the index are only read.
+ */
+
+struct precheck_context {
+    ext2_filsys fs;
+    struct extent_index *idx;
+    dgrp_t first_group, last_group;
+    __u64 first_rec, last_rec;
+    struct precheck_result res;
+    errcode_t error;
+};
+
+static void note_group(struct precheck_result *res, dgrp_t g) {
+    if (!res->bad_group_found || g < res->bad_group) {
+        res->bad_group = g;
+        res->bad_group_found = 1;
+    }
+}
+
+static void note_inode(struct precheck_result *res, ext2_ino_t ino) {
+    if (!res->bad_ino || ino < res->bad_ino)
+        res->bad_ino = ino;
+}
+
+static __u64 inode_popcount(ext2fs_inode_bitmap bmap, ext2_ino_t start, __u32 n, __u64 *buf, size_t size) {
+    __u64 total = 0;
+    size_t i;
+
+    memset(buf, 0, size);
+    if (ext2fs_get_inode_bitmap_range2(bmap, start, n, buf))
+        return 0;
+    for (i = 0; i < n / 64; i++)
+        total += __builtin_popcountll(buf[i]);
+    if (n % 64)
+        total += __builtin_popcountll(buf[i] & ((1ULL << (n % 64)) - 1));
+    return total;
+}
+
+/*
+ * 组的位图校验和按磁盘上的整块计算, 最后一个组超出文件系统的位是1
+ */
+static int block_bitmap_csum_ok(ext2_filsys fs, dgrp_t g, unsigned char *buf, size_t size) {
+    blk64_t first = ext2fs_group_first_block2(fs, g), last = ext2fs_group_last_block2(fs, g);
+    __u64 bits = EXT2_CLUSTERS_PER_GROUP(fs->super), n = last - first + 1, i;
+
+    memset(buf, 0, size);
+    if (ext2fs_get_block_bitmap_range2(fs->block_map, first, n, buf))
+        return 0;
+    for (i = n; i < bits; i++)
+        buf[i / 8] |= 1 << (i % 8);
+    return ext2fs_block_bitmap_csum_verify(fs, g, (char *)buf, bits / 8);
+}
+
+static void check_groups(struct precheck_context *ctx, void *buf, size_t size) {
+    ext2_filsys fs = ctx->fs;
+    struct precheck_result *res = &ctx->res;
+    __u32 ipg = EXT2_INODES_PER_GROUP(fs->super);
+    int bigalloc = ext2fs_has_feature_bigalloc(fs->super);
+    int csum = ext2fs_has_feature_metadata_csum(fs->super);
+    blk64_t first, last;
+    __u64 used;
+    dgrp_t g;
+
+    for (g = ctx->first_group; g < ctx->last_group; g++) {
+        /* bigalloc的描述符按簇计数, 只比较inode */
+        if (!bigalloc) {
+            first = ext2fs_group_first_block2(fs, g);
+            last = ext2fs_group_last_block2(fs, g);
+            used = bitmap_popcount(fs->block_map, first, last - first + 1);
+            if (last - first + 1 - used != ext2fs_bg_free_blocks_count(fs, g)) {
+                res->bad_free_blocks++;
+                note_group(res, g);
+            }
+        }
+        used = inode_popcount(fs->inode_map, g * ipg + 1, ipg, buf, size);
+        if (ipg - used != ext2fs_bg_free_inodes_count(fs, g)) {
+            res->bad_free_inodes++;
+            note_group(res, g);
+        }
+
+        if (ext2fs_has_group_desc_csum(fs) && !ext2fs_group_desc_csum_verify(fs, g)) {
+            res->bad_csum++;
+            note_group(res, g);
+        }
+        if (!csum)
+            continue;
+        if (!bigalloc && !ext2fs_bg_flags_test(fs, g, EXT2_BG_BLOCK_UNINIT) && !block_bitmap_csum_ok(fs, g, buf, size)) {
+            res->bad_csum++;
+            note_group(res, g);
+        }
+        if (!ext2fs_bg_flags_test(fs, g, EXT2_BG_INODE_UNINIT)) {
+            memset(buf, 0, size);
+            if (ext2fs_get_inode_bitmap_range2(fs->inode_map, g * ipg + 1, ipg, buf)
+                || !ext2fs_inode_bitmap_csum_verify(fs, g, buf, ipg / 8)) {
+                res->bad_csum++;
+                note_group(res, g);
+            }
+        }
+    }
+}
+
+/* 两条记录重叠: 同一个xattr块可以被多个inode共享 */
+static void check_overlap(struct precheck_result *res, const struct extent_rec *owner, const struct extent_rec *r) {
+    blk64_t end = owner->pblk + owner->len;
+
+    if (r->ino == owner->ino || r->pblk >= end)
+        return;
+    if (owner->flags & r->flags & EREC_META && owner->len == 1 && r->len == 1 && owner->pblk == r->pblk) {
+        res->shared++;
+        return;
+    }
+    res->multiply_claimed += (r->pblk + r->len < end ? r->pblk + r->len : end) - r->pblk;
+    note_inode(res, owner->ino);
+    note_inode(res, r->ino);
+}
+
+static void check_records(struct precheck_context *ctx) {
+    ext2_filsys fs = ctx->fs;
+    struct extent_index *idx = ctx->idx;
+    struct precheck_result *res = &ctx->res;
+    blk64_t first = fs->super->s_first_data_block, blocks = ext2fs_blocks_count(fs->super);
+    const struct extent_rec *r, *owner = NULL;
+    __u64 i, j, used;
+
+    if (ctx->first_rec >= ctx->last_rec)
+        return;
+
+    /*
+     * 与本段开头重叠的记录起点不会早于 pblk - max_len,
+     * so the owner of the first record is found without the previous range.
+     */
+    r = idx->recs + ctx->first_rec;
+    for (j = ctx->first_rec; j > 0 && idx->recs[j - 1].pblk + idx->max_len > r->pblk; j--)
+        ;
+    for (; j < ctx->first_rec; j++)
+        if (!owner || idx->recs[j].pblk + idx->recs[j].len > owner->pblk + owner->len)
+            owner = idx->recs + j;
+
+    for (i = ctx->first_rec; i < ctx->last_rec; i++) {
+        r = idx->recs + i;
+        if (r->pblk < first || r->pblk >= blocks || r->len > blocks - r->pblk) {
+            res->out_of_bounds++;
+            note_inode(res, r->ino);
+            continue;
+        }
+        used = bitmap_popcount(fs->block_map, r->pblk, r->len);
+        if (used != r->len) {
+            res->unmarked += r->len - used;
+            note_inode(res, r->ino);
+        }
+        if (owner)
+            check_overlap(res, owner, r);
+        if (!owner || r->pblk + r->len > owner->pblk + owner->len)
+            owner = r;
+    }
+}
+
+static void *precheck_proc(void *arg) {
+    struct precheck_context *ctx = (struct precheck_context *)arg;
+    size_t size = (EXT2_INODES_PER_GROUP(ctx->fs->super) > EXT2_CLUSTERS_PER_GROUP(ctx->fs->super)
+                   ? EXT2_INODES_PER_GROUP(ctx->fs->super) : EXT2_CLUSTERS_PER_GROUP(ctx->fs->super)) / 8 + 8;
+    __u64 *buf, ts = trace_now();
+
+    if (ctx->error = ext2fs_get_mem(size, &buf))
+        return NULL;
+    check_groups(ctx, buf, size);
+    check_records(ctx);
+    ext2fs_free_mem(&buf);
+    trace_span("precheck", "precheck_range", ts, "\"groups\":%u,\"records\":%llu",
+               ctx->last_group - ctx->first_group, (unsigned long long)(ctx->last_rec - ctx->first_rec));
+    return NULL;
+}
+
+errcode_t precheck_run(ext2_filsys fs, int nthreads, struct precheck_result *res) {
+    struct precheck_context *ctx = NULL;
+    struct precheck_result *r;
+    errcode_t retval;
+    int i;
+
+    if (retval = bitmaps_load(fs, move_threads, NULL))
+        return retval;
+    if (retval = fs_index_load(fs))
+        return retval;
+
+    if (nthreads < 1)
+        nthreads = 1;
+    if (retval = ext2fs_get_arrayzero(nthreads, sizeof(struct precheck_context), &ctx))
+        return retval;
+
+    for (i = 0; i < nthreads; i++) {
+        ctx[i].fs = fs;
+        ctx[i].idx = fs_index;
+        ctx[i].first_group = (__u64)fs->group_desc_count * i / nthreads;
+        ctx[i].last_group = (__u64)fs->group_desc_count * (i + 1) / nthreads;
+        ctx[i].first_rec = fs_index->count * i / nthreads;
+        ctx[i].last_rec = fs_index->count * (i + 1) / nthreads;
+    }
+    run_parallel(nthreads, precheck_proc, ctx, sizeof(struct precheck_context));
+
+    memset(res, 0, sizeof(struct precheck_result));
+    for (i = 0; i < nthreads; i++) {
+        r = &ctx[i].res;
+        if (!retval)
+            retval = ctx[i].error;
+        res->bad_free_blocks += r->bad_free_blocks;
+        res->bad_free_inodes += r->bad_free_inodes;
+        res->bad_csum += r->bad_csum;
+        res->out_of_bounds += r->out_of_bounds;
+        res->unmarked += r->unmarked;
+        res->multiply_claimed += r->multiply_claimed;
+        res->shared += r->shared;
+        if (r->bad_group_found)
+            note_group(res, r->bad_group);
+        if (r->bad_ino)
+            note_inode(res, r->bad_ino);
+    }
+
+    ext2fs_free_mem(&ctx);
+    return retval;
+}
+
+int precheck_failed(struct precheck_result *res) {
+    return res->bad_free_blocks || res->bad_free_inodes || res->bad_csum || res->out_of_bounds || res->unmarked
+        || res->multiply_claimed;
+}
+
+/* 一行摘要, 用于界面和命令行 */
+void precheck_summary(struct precheck_result *res, char *buf, size_t size) {
+    int n;
+
+    if (!precheck_failed(res)) {
+        snprintf(buf, size, "Precheck passed (%llu shared xattr blocks)", (unsigned long long)res->shared);
+        return;
+    }
+    n = snprintf(buf, size, "Precheck failed: %llu/%llu groups with wrong free blocks/inodes, %llu bad checksums, "
+                 "%llu runs out of bounds, %llu owned blocks free, %llu blocks multiply claimed",
+                 (unsigned long long)res->bad_free_blocks, (unsigned long long)res->bad_free_inodes,
+                 (unsigned long long)res->bad_csum, (unsigned long long)res->out_of_bounds,
+                 (unsigned long long)res->unmarked, (unsigned long long)res->multiply_claimed);
+    if (n > 0 && (size_t)n < size && res->bad_group_found)
+        n += snprintf(buf + n, size - n, ", first bad group %u", res->bad_group);
+    if (n > 0 && (size_t)n < size && res->bad_ino)
+        snprintf(buf + n, size - n, ", first bad inode %u", res->bad_ino);
+}
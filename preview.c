@@ -15,6 +15,8 @@ struct print_block_cell {
     __u16 pos;   // cell index
     __u32 count; // blocks in cell
     __u32 size;
+    __u32 overlay; // blocks of the overlay file in cell
+    __u8 cls;      // dominant BCLASS_*, when classified
 };
 
 struct print_block_context {
@@ -28,6 +30,8 @@ struct print_block_context {
     int count;
     __u64 blocks;
     int pos;
+    volatile int walked; // thread_walk_blocks has finished
+    ext2fs_block_bitmap bmap; // NULL until the bitmaps are loaded, counts are estimated
 
     ext2_ino_t ino;
     __u64 isize;
@@ -81,7 +85,7 @@ static void print_blocks(struct print_block_context *ctx, struct print_block_cel
         } else
             ch = "@";
 
-    color = FISSET(bc->flag, FLAG_SELECTED) ? CP_HL : bc->color;
+    color = FISSET(bc->flag, FLAG_SELECTED) ? CP_HL : bc->overlay ? CP_OVL : bc->color;
     x = ctx->left + bc->pos % ctx->width;
     y = ctx->top + bc->pos / ctx->width;
 
@@ -139,7 +143,7 @@ static int show_detail(struct print_block_context *ctx, int offset, int blk_inde
         current_blk = blk_index;
 
     if (offset <= 0 && current_blk < 0) {
-        mvwprintw(ctx->win, ctx->height + 0, 00, "Use Arrow key to view details");
+        mvwprintw(ctx->win, ctx->height + 0, 00, "Arrows: details, Enter: list files, o: highlight a file, c: classify blocks");
         return 0;
     }
 
@@ -177,6 +181,11 @@ static int show_detail(struct print_block_context *ctx, int offset, int blk_inde
               tmp1,
               tmp2);
     mvwprintw(ctx->win, ctx->height + 2, 00, "Pack Count: %d", ctx->count);
+    if (ctx->inode)
+        mvwprintw(ctx->win, ctx->height + 2, 20 + count_digits(ctx->count), "File #%u: %s in pack",
+                  ctx->ino, format_bytes((__u64)blk->overlay * block_size, size, 15));
+    if (blk->cls)
+        mvwprintw(ctx->win, ctx->height + 2, ctx->width - 28, "Mostly: %s", block_class_name[blk->cls]);
 
     FUNSET(blk->flag, FLAG_PRINTED);
     FSET(blk->flag, FLAG_SELECTED);
@@ -186,6 +195,141 @@ static int show_detail(struct print_block_context *ctx, int offset, int blk_inde
     return 0;
 }
 
+static int block_cell(struct print_block_context *ctx, blk64_t blk) {
+    return (int)((double)ctx->count / ctx->blocks * (blk - fs->super->s_first_data_block + 1));
+}
+
+/* 单元格的第一个块, block_cell的反函数 */
+static blk64_t cell_first(struct print_block_context *ctx, int idx) {
+    blk64_t first = fs->super->s_first_data_block, blk;
+
+    if (idx <= 0)
+        return first;
+    if (idx >= ctx->count)
+        return ctx->blocks;
+
+    blk = (blk64_t)((double)ctx->blocks / ctx->count * idx) + first;
+    blk = blk > first + 2 ? blk - 2 : first;
+    while (blk > first && block_cell(ctx, blk - 1) >= idx)
+        blk--;
+    while (blk < ctx->blocks && block_cell(ctx, blk) < idx)
+        blk++;
+
+    return blk;
+}
+
+static void cell_range(struct print_block_context *ctx, int pos, blk64_t *start, blk64_t *end) {
+    *start = cell_first(ctx, pos);
+    *end = cell_first(ctx, pos + 1);
+    if (*end <= *start)
+        *end = *start + 1;
+}
+
+static void print_owner(WINDOW *win, int y, int width, struct index_owner *o) {
+    char size[16], *name = NULL;
+    const char *kind = "";
+
+    if (o->flags & EREC_RSV)
+        kind = "[reserved] ";
+    else if (o->flags & EREC_META && !(o->flags & ~(EREC_META | EREC_DIR)))
+        kind = "[meta] ";
+
+    win_clear(win, y, 1, width - 2);
+    if (extent_index_pathname(fs, fs_index, o->ino, &name))
+        name = NULL;
+    mvwprintw(win, y, 2, "%10s  #%-10u %s%.*s",
+              format_bytes(o->blocks * block_size, size, 15), o->ino, kind,
+              width - 40 > 0 ? width - 40 : 0, name ? name : "?");
+    if (name)
+        ext2fs_free_mem(&name);
+}
+
+/*
+ * 列出当前单元格内的文件, 按占用字节数排序
+ */
+static int show_files(struct print_block_context *ctx) {
+    struct index_owner *list = NULL;
+    blk64_t start, end;
+    errcode_t retval;
+    WINDOW *win;
+    int i, n, x, y, rows, top = 0, redraw = 1;
+
+    if (current_blk < 0 || current_blk >= ctx->count)
+        return 0;
+
+    if (!fs_index) {
+        win_clear(ctx->win, ctx->height + 2, 30, ctx->width - 30);
+        mvwprintw(ctx->win, ctx->height + 2, 30, "Building extent index ...");
+        wrefresh(ctx->win);
+        retval = fs_index_load(fs);
+        win_clear(ctx->win, ctx->height + 2, 30, ctx->width - 30);
+        wrefresh(ctx->win);
+        if (retval) {
+            serr("fs_index_load", retval, "while building extent index");
+            return EX_DEVICE;
+        }
+    }
+
+    cell_range(ctx, ctx->blocks_start[current_blk].pos, &start, &end);
+    if (retval = extent_index_owners(fs_index, start, end, &list, &n)) {
+        serr("extent_index_owners", retval, "while looking up blocks %llu-%llu", start, end);
+        return EX_DEVICE;
+    }
+
+    getmaxyx(stdscr, y, x);
+    win = newwin(y * 3 / 4, x * 3 / 4, y / 8, x / 8);
+    getmaxyx(win, y, x);
+    rows = y - 3;
+    keypad(win, TRUE);
+
+    for (;;) {
+        if (redraw) {
+            werase(win);
+            box(win, 0, 0);
+            wattron(win, COLOR_PAIR(CP_HL));
+            mvwprintw(win, 0, 2, " Blocks %llu-%llu: %d files ", start, end - 1, n);
+            wattroff(win, COLOR_PAIR(CP_HL));
+            for (i = 0; i < rows && top + i < n; i++)
+                print_owner(win, i + 1, x, list + top + i);
+            if (n == 0)
+                mvwprintw(win, 1, 2, "No file in this range");
+            mvwprintw(win, y - 1, 2, " %d-%d/%d ", n ? top + 1 : 0, top + i, n);
+            wrefresh(win);
+            redraw = 0;
+        }
+
+        int ch = wgetch(win);
+        switch (ch) {
+        case 27:
+        case '\n':
+        case 'q': goto _quit;
+        case KEY_UP:
+            if (top > 0)
+                top--, redraw = 1;
+            break;
+        case KEY_DOWN:
+            if (top + rows < n)
+                top++, redraw = 1;
+            break;
+        case KEY_PPAGE:
+            top = top > rows ? top - rows : 0;
+            redraw = 1;
+            break;
+        case KEY_NPAGE:
+            if (top + rows < n)
+                top += rows, redraw = 1;
+            break;
+        }
+    }
+
+_quit:
+    delwin(win);
+    ext2fs_free_mem(&list);
+    touchwin(ctx->win);
+    wrefresh(ctx->win);
+    return 0;
+}
+
 static int mouse_event(struct print_block_context *ctx) {
     MEVENT event;
     if (getmouse(&event) != OK)
@@ -195,61 +339,227 @@ static int mouse_event(struct print_block_context *ctx) {
 
     // if (event.bstate & BUTTON1_CLICKED)
     show_detail(ctx, 0, (event.x - 1 - ctx->left) + (event.y - 1 - ctx->top) * ctx->width);
+
+    if (event.bstate & BUTTON1_CLICKED)
+        return show_files(ctx);
+    return 0;
 }
 
-static void *thread_walk_blocks(void *arg) {
-    struct print_block_context *ctx = (struct print_block_context *)arg;
-    __u64 blknum;
-    struct print_block_cell *bc, *last = NULL;
-    int i, size;
-    int idx, has, ret = 0;
-    double blk_cells, cell_blks;
+struct overlay_context {
+    struct print_block_context *ctx;
+    __u64 blocks;
+    __u64 runs;
+};
 
-    blk_cells = (double)ctx->count / ctx->blocks;
-    cell_blks = (double)ctx->blocks / ctx->count;
+static int overlay_add_run(const struct extent_rec *rec, void *priv) {
+    struct overlay_context *oc = (struct overlay_context *)priv;
+    struct print_block_context *ctx = oc->ctx;
+    blk64_t blk = rec->pblk, end = rec->pblk + rec->len, next;
+    int idx;
 
-    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    if (end > ctx->blocks)
+        end = ctx->blocks;
 
-    for (blknum = fs->super->s_first_data_block; blknum < ctx->blocks; blknum++) {
-        has = ext2fs_test_block_bitmap2(fs->block_map, blknum);
+    oc->runs++;
+    while (blk < end) {
+        idx = block_cell(ctx, blk);
+        if (idx < 0 || idx >= ctx->count)
+            break;
 
-        idx = (int)(blk_cells * (blknum - fs->super->s_first_data_block + 1));
-        size = (int)((__u64)(cell_blks * (idx + 1)) - (__u64)(cell_blks * idx));
+        next = cell_first(ctx, idx + 1);
+        if (next > end)
+            next = end;
 
-        if (idx < 0 || idx >= ctx->count)
+        ctx->blocks_start[idx].overlay += next - blk;
+        oc->blocks += next - blk;
+        blk = next;
+    }
+
+    return 0;
+}
+
+static void clear_overlay(struct print_block_context *ctx) {
+    struct print_block_cell *bc;
+
+    for (bc = ctx->blocks_start; bc < ctx->blocks_start + ctx->count; bc++) {
+        if (!bc->overlay)
             continue;
-        bc = ctx->blocks_start + idx;
-        // if (bc->size && bc->count >= bc->size)
-        //     bc++;
+        bc->overlay = 0;
+        FUNSET(bc->flag, FLAG_PRINTED);
+        print_blocks(ctx, bc);
+    }
+    if (ctx->inode)
+        ext2fs_free_mem(&ctx->inode);
+    ctx->ino = 0;
+    ctx->isize = 0;
+}
 
-        if (bc->color == 0) { // init it
-            bc->pos = idx;
-            bc->color = CP_EMP;
-            bc->size = size;
-        }
-        bc->count += !!has;
-
-        if (last != bc) {
-            if (last) {
-                if (last->count)
-                    last->color = CP_DAT;
-                else
-                    last->color = CP_EMP;
-                print_blocks(ctx, last);
-            }
-            last = bc;
-        }
+/*
+ * 高亮一个文件占用的所有单元格
+ *
+ * The path is resolved with ext2fs_namei and the per-cell counts come from a
+ * single walk of the file's extent tree, the bitmap is not rescanned.
+ */
+static int show_overlay(struct print_block_context *ctx) {
+    struct overlay_context oc = {0};
+    struct print_block_cell *bc;
+    char path[256], size[16];
+    errcode_t retval;
+    ext2_ino_t ino;
+
+    if (retval = readline("Input the file path to highlight.\n"
+                          "eg. '/var/lib/mysql/ibdata1'\n"
+                          "empty input clears the overlay",
+                          path, sizeof(path) - 1)) {
+        retval = retval == EX_QUIT ? 0 : retval;
+        goto _redraw;
+    }
+
+    clear_overlay(ctx);
+    if (path[0] == 0)
+        goto _redraw;
+
+    if (retval = ext2fs_namei(fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino)) {
+        serr(path, retval, "while looking up file");
+        goto _redraw;
+    }
+    if (retval = ext2fs_get_mem(sizeof(struct ext2_inode), &ctx->inode))
+        goto _redraw;
+    if (retval = ext2fs_read_inode(fs, ino, ctx->inode)) {
+        ext2fs_free_mem(&ctx->inode);
+        serr(path, retval, "while reading inode %u", ino);
+        goto _redraw;
+    }
+    ctx->ino = ino;
+    ctx->isize = EXT2_I_SIZE(ctx->inode);
+
+    oc.ctx = ctx;
+    if (retval = inode_walk_runs(fs, ino, ctx->inode, overlay_add_run, &oc)) {
+        serr(path, retval, "while walking extents of inode %u", ino);
+        clear_overlay(ctx);
+        goto _redraw;
+    }
+
+_redraw:
+    touchwin(ctx->win);
+    for (bc = ctx->blocks_start; bc < ctx->blocks_start + ctx->count; bc++) {
+        if (!bc->overlay)
+            continue;
+        FUNSET(bc->flag, FLAG_PRINTED);
+        print_blocks(ctx, bc);
+    }
+    if (ctx->inode) {
+        win_clear(ctx->win, ctx->height + 2, 30, ctx->width - 30);
+        mvwprintw(ctx->win, ctx->height + 2, 30, "#%u size %s, %llu runs",
+                  ctx->ino, format_bytes(ctx->isize, size, 15), oc.runs);
+    }
+    wrefresh(ctx->win);
+    return retval;
+}
+
+static __u8 class_color(int cls) {
+    switch (cls) {
+    case BCLASS_SUPER:
+    case BCLASS_BITMAP:
+    case BCLASS_ITABLE:
+    case BCLASS_RESERVED: return CP_RSV;
+    case BCLASS_JOURNAL: return CP_JNL;
+    case BCLASS_DIR: return CP_DIR;
+    case BCLASS_META: return CP_META;
+    default: return CP_DAT;
+    }
+}
+
+/* 统计单元格 [start, end) 并按主要类别着色 */
+static void count_cell(struct print_block_context *ctx, struct print_block_cell *bc, blk64_t start, blk64_t end) {
+    __u64 counts[BCLASS_MAX] = {0};
+
+    bc->size = end - start;
+    bc->count = density_count(fs_density, ctx->bmap, start, end);
+    bc->cls = BCLASS_FREE;
+    if (bc->count && fs_classes) {
+        class_map_count(fs_classes, start, end, counts);
+        bc->cls = class_map_dominant(counts, bc->count);
+    }
+    bc->color = !bc->count ? CP_EMP : bc->cls ? class_color(bc->cls) : CP_DAT;
+}
+
+/*
+ * 每个单元格的已用块数来自密度金字塔, 与位图大小无关.
+ * Without bitmaps (the first frame after a scan cache hit) the cells
+ * cutting a chunk are estimated; do_preview walks again once they are
+ * loaded.
+ */
+static void *thread_walk_blocks(void *arg) {
+    struct print_block_context *ctx = (struct print_block_context *)arg;
+    struct print_block_cell *bc;
+    blk64_t start, end;
+    int idx;
+    __u64 ts = trace_now();
+
+    trace_thread_name("thread_walk_blocks");
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+    for (idx = 0, end = cell_first(ctx, 0); idx < ctx->count; idx++) {
+        start = end;
+        end = cell_first(ctx, idx + 1);
+        if (end <= start)
+            continue;
+
+        bc = ctx->blocks_start + idx;
+        bc->pos = idx;
+        count_cell(ctx, bc, start, end);
+        FUNSET(bc->flag, FLAG_PRINTED);
+        print_blocks(ctx, bc);
     }
-    print_blocks(ctx, bc);
     show_detail(ctx, 0, -1);
+    trace_span("preview", "walk_blocks", ts, "\"cells\":%d", ctx->count);
+    ctx->walked = 1;
 
-_exit:
     pthread_exit(NULL);
 }
 
+/* 按块类别重新着色, 需要时先建立区间索引 */
+static int show_classes(struct print_block_context *ctx) {
+    struct print_block_cell *bc;
+    errcode_t retval;
+    __u64 ts;
+    int idx;
+
+    if (!ctx->walked)
+        return 0;
+
+    if (!fs_classes) {
+        win_clear(ctx->win, ctx->height + 2, 30, ctx->width - 30);
+        mvwprintw(ctx->win, ctx->height + 2, 30, "Classifying blocks ...");
+        wrefresh(ctx->win);
+        ts = trace_now();
+        if (!(retval = fs_index_load(fs)))
+            retval = class_map_build(fs, fs_index, &fs_classes);
+        trace_span("scan", "class_map_build", ts, NULL);
+        win_clear(ctx->win, ctx->height + 2, 30, ctx->width - 30);
+        if (retval) {
+            serr("class_map_build", retval, "while classifying blocks");
+            return EX_DEVICE;
+        }
+    }
+
+    for (idx = 0; idx < ctx->count; idx++) {
+        bc = ctx->blocks_start + idx;
+        if (!bc->color)
+            continue;
+        count_cell(ctx, bc, cell_first(ctx, idx), cell_first(ctx, idx + 1));
+        FUNSET(bc->flag, FLAG_PRINTED);
+        print_blocks(ctx, bc);
+    }
+    wrefresh(ctx->win);
+    return 0;
+}
+
 int do_preview(WINDOW *win) {
     ext2fs_block_bitmap block_bitmap;
     int ret = 0;
+    __u64 ts;
     struct print_block_context ctx = {0};
     int size, cursor;
     pthread_t thread;
@@ -276,10 +586,60 @@ int do_preview(WINDOW *win) {
     memset(ctx.blocks_start, 0, size);
     ctx.blocks_end = ctx.blocks_start + ctx.count + 1;
 
+    if (!fs_density) {
+        if (ret = bitmaps_load(fs, move_threads, NULL)) {
+            serr("bitmaps_load", ret, "while reading bitmaps");
+            ret = EX_DEVICE;
+            goto _free;
+        }
+        mvwprintw(win, 0, 0, "Building density map ...");
+        wrefresh(win);
+        ts = trace_now();
+        if (ret = density_build(fs, fs->block_map, move_threads, &fs_density)) {
+            serr("density_build", ret, "while counting used blocks");
+            ret = EX_DEVICE;
+            goto _free;
+        }
+        trace_span("scan", "density_build", ts, NULL);
+        win_clear(win, 0, 0, ctx.x);
+    }
+    /* 区间索引已在内存中 (扫描缓存或之前的查询), 分类不需要I/O */
+    if (!fs_classes && fs_index) {
+        ts = trace_now();
+        if (class_map_build(fs, fs_index, &fs_classes) == 0)
+            trace_span("scan", "class_map_build", ts, NULL);
+    }
+
+    ctx.bmap = fs->block_map && fs->inode_map ? fs->block_map : NULL;
     if (pthread_create(&thread, NULL, thread_walk_blocks, &ctx)) {
         serr(prog_name, 0, "create thread error", NULL);
         ret = EX_OSERR;
-        goto _exit;
+        goto _free;
+    }
+
+    /*
+     * 扫描缓存命中: the first frame comes from the density map alone, then
+     * the bitmaps are loaded with no walker running (file queries would
+     * otherwise load them under it) and the cells are counted exactly.
+     */
+    if (!ctx.bmap) {
+        pthread_join(thread, NULL);
+        mvwprintw(win, ctx.height + 2, 30, "Reading bitmaps ...");
+        wrefresh(win);
+        ret = bitmaps_load(fs, move_threads, NULL);
+        win_clear(win, ctx.height + 2, 30, ctx.width - 30);
+        if (ret) {
+            serr("bitmaps_load", ret, "while reading bitmaps");
+            ret = EX_DEVICE;
+            goto _free;
+        }
+        ctx.bmap = fs->block_map;
+        ctx.walked = 0;
+        if (pthread_create(&thread, NULL, thread_walk_blocks, &ctx)) {
+            serr(prog_name, 0, "create thread error", NULL);
+            ret = EX_OSERR;
+            goto _free;
+        }
     }
     pthread_detach(thread);
 
@@ -296,6 +656,10 @@ int do_preview(WINDOW *win) {
         case KEY_END: show_detail(&ctx, ctx.width - (current_blk % ctx.width) - 1, -1); break;
         case KEY_HOME: show_detail(&ctx, -(current_blk % ctx.width), -1); break;
         case KEY_MOUSE: mouse_event(&ctx); break;
+        case '\n':
+        case KEY_ENTER: show_files(&ctx); break;
+        case 'o': show_overlay(&ctx); break;
+        case 'c': show_classes(&ctx); break;
         default:
             break;
         }
@@ -304,6 +668,9 @@ int do_preview(WINDOW *win) {
 _exit:
     pthread_cancel(thread);
 
+_free:
+    if (ctx.inode)
+        ext2fs_free_mem(&ctx.inode);
     free(ctx.blocks_start);
 
     curs_set(cursor);
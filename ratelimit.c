@@ -0,0 +1,139 @@
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "e2blk.h"
+
+/*
+ * 令牌桶限速
+ *
+ * One bucket for bytes and one for I/O requests, shared by all move threads.
+ * A caller may take more than the bucket holds (a whole task), the debt is
+ * paid by the next callers, so the long term rate is exact. Sleeps are cut
+ * in slices so a rate changed from the UI applies within RATE_SLICE_NS.
+ */
+
+#define RATE_BURST 0.1            // seconds of tokens the bucket holds
+#define RATE_SLICE_NS 100000000L
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+unsigned int rate_mbps = 0;
+unsigned int rate_iops = 0;
+int io_priority = -1;
+
+static double now_seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void rate_limit_init(struct rate_limit *rl, __u64 bytes_rate, __u64 iops_rate) {
+    memset(rl, 0, sizeof(struct rate_limit));
+    pthread_mutex_init(&rl->lock, NULL);
+    rl->bytes_rate = bytes_rate;
+    rl->iops_rate = iops_rate;
+    rl->last = now_seconds();
+}
+
+void rate_limit_destroy(struct rate_limit *rl) {
+    pthread_mutex_destroy(&rl->lock);
+}
+
+/* 0 means unlimited */
+void rate_limit_set(struct rate_limit *rl, __u64 bytes_rate, __u64 iops_rate) {
+    pthread_mutex_lock(&rl->lock);
+    rl->bytes_rate = bytes_rate;
+    rl->iops_rate = iops_rate;
+    if (!bytes_rate)
+        rl->bytes = 0;
+    if (!iops_rate)
+        rl->ios = 0;
+    pthread_mutex_unlock(&rl->lock);
+}
+
+void rate_limit_get(struct rate_limit *rl, __u64 *bytes_rate, __u64 *iops_rate) {
+    pthread_mutex_lock(&rl->lock);
+    *bytes_rate = rl->bytes_rate;
+    *iops_rate = rl->iops_rate;
+    pthread_mutex_unlock(&rl->lock);
+}
+
+static void refill(struct rate_limit *rl) {
+    double now = now_seconds(), elapsed = now - rl->last;
+
+    rl->last = now;
+    if (rl->bytes_rate) {
+        rl->bytes += elapsed * rl->bytes_rate;
+        if (rl->bytes > rl->bytes_rate * RATE_BURST)
+            rl->bytes = rl->bytes_rate * RATE_BURST;
+    }
+    if (rl->iops_rate) {
+        rl->ios += elapsed * rl->iops_rate;
+        if (rl->ios > rl->iops_rate * RATE_BURST)
+            rl->ios = rl->iops_rate * RATE_BURST;
+    }
+}
+
+/* 等到两个桶都不欠债, 再取走 `bytes` 和 `ios` */
+void rate_limit_wait(struct rate_limit *rl, __u64 bytes, __u32 ios) {
+    struct timespec ts = {0};
+    double wait;
+
+    for (;;) {
+        pthread_mutex_lock(&rl->lock);
+        refill(rl);
+        wait = 0;
+        if (rl->bytes_rate && rl->bytes < 0)
+            wait = -rl->bytes / rl->bytes_rate;
+        if (rl->iops_rate && rl->ios < 0 && -rl->ios / rl->iops_rate > wait)
+            wait = -rl->ios / rl->iops_rate;
+        if (wait <= 0) {
+            if (rl->bytes_rate)
+                rl->bytes -= bytes;
+            if (rl->iops_rate)
+                rl->ios -= ios;
+            pthread_mutex_unlock(&rl->lock);
+            return;
+        }
+        pthread_mutex_unlock(&rl->lock);
+
+        ts.tv_nsec = wait * 1e9 < RATE_SLICE_NS ? (long)(wait * 1e9) + 1 : RATE_SLICE_NS;
+        nanosleep(&ts, NULL);
+    }
+}
+
+/*
+ * "idle", "be[:level]" or "rt[:level]", level 0 (highest) to 7.
+ * Returns the ioprio value or -1.
+ */
+int parse_ioprio(const char *str) {
+    int class, level = 4;
+    const char *p = strchr(str, ':');
+    size_t len = p ? (size_t)(p - str) : strlen(str);
+    char *end;
+
+    if (len == 4 && !strncmp(str, "idle", 4))
+        return (3 << IOPRIO_CLASS_SHIFT) | 7;
+    if (len == 2 && !strncmp(str, "rt", 2))
+        class = 1;
+    else if (len == 2 && !strncmp(str, "be", 2))
+        class = 2;
+    else
+        return -1;
+
+    if (p) {
+        level = strtol(p + 1, &end, 10);
+        if (end == p + 1 || *end || level < 0 || level > 7)
+            return -1;
+    }
+    return (class << IOPRIO_CLASS_SHIFT) | level;
+}
+
+/* 设置调用线程的I/O优先级, 对BFQ和mq-deadline调度器有效 */
+errcode_t set_thread_ioprio(int ioprio) {
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) < 0)
+        return errno;
+    return 0;
+}
@@ -0,0 +1,364 @@
+#include <time.h>
+
+#include "e2blk.h"
+
+/*
+ * 模拟机械盘的io_manager
+ *
+ * Stacked over another manager (sim_io_backing, unix_io_manager by
+ * default), it forwards every request and charges it to a disk model:
+ * seek time growing with the square root of the head travel, half a
+ * rotation per non-sequential request and a media transfer rate. Several
+ * disks striped RAID-0 style each keep their own head. The move workers do
+ * not use fs->io, copy.c charges their requests through sim_account().
+ *
+ * The simulated busy time is accumulated per disk; with "delay" the caller
+ * also sleeps until its request would have completed, so the whole move
+ * runs at HDD speed on an SSD or tmpfs image.
+ */
+
+#define SIM_MAX_DISKS 64
+
+struct sim_disk {
+    __u64 head;        // byte after the last request, on this disk
+    double busy;       // simulated seconds
+    double busy_until; // wall clock when the disk is idle again, with delay
+};
+
+struct sim_private_data {
+    io_channel real;
+};
+
+int sim_enabled = 0;
+io_manager sim_io_backing = NULL;
+
+static struct {
+    double rpm;
+    double seek_min;  // ms, track to track
+    double seek_max;  // ms, full stroke
+    double bandwidth; // bytes per second of one disk
+    __u64 capacity;   // bytes of one disk
+    int disks;
+    __u64 stripe;     // bytes
+    int delay;
+} sim_model = {7200, 0.5, 16.0, 180.0 * 1048576, 0, 1, 512 * 1024, 0};
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sim_disk sim_disks[SIM_MAX_DISKS];
+static __u64 sim_requests, sim_seeks, sim_read, sim_written;
+static double sim_start;
+
+static double sim_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int parse_size(const char *str, __u64 *ret) {
+    char *end;
+    double v = strtod(str, &end);
+
+    switch (*end) {
+    case 'G': v *= 1024; // fall through
+    case 'M': v *= 1024; // fall through
+    case 'K': v *= 1024; end++;
+    }
+    if (end == str || *end || v <= 0)
+        return -1;
+    *ret = (__u64)v;
+    return 0;
+}
+
+/*
+ * "hdd" 或逗号分隔的参数: rpm=N, seek=MIN:MAX (ms), bw=SIZE (per second),
+ * disks=N, stripe=SIZE, delay. Unset parameters keep the 7200 rpm defaults.
+ */
+errcode_t sim_parse(const char *spec) {
+    char *buf, *tok, *save, *val;
+    errcode_t retval = 0;
+    __u64 v;
+
+    if (retval = ext2fs_get_mem(strlen(spec) + 1, &buf))
+        return retval;
+    strcpy(buf, spec);
+
+    for (tok = strtok_r(buf, ",", &save); tok && !retval; tok = strtok_r(NULL, ",", &save)) {
+        val = strchr(tok, '=');
+        if (val)
+            *val++ = 0;
+        if (!strcmp(tok, "hdd") && !val)
+            continue;
+        if (!strcmp(tok, "delay") && !val)
+            sim_model.delay = 1;
+        else if (!val)
+            retval = EXT2_ET_INVALID_ARGUMENT;
+        else if (!strcmp(tok, "rpm"))
+            retval = (sim_model.rpm = atof(val)) > 0 ? 0 : EXT2_ET_INVALID_ARGUMENT;
+        else if (!strcmp(tok, "seek"))
+            retval = sscanf(val, "%lf:%lf", &sim_model.seek_min, &sim_model.seek_max) == 2
+                     && sim_model.seek_min >= 0 && sim_model.seek_max >= sim_model.seek_min ? 0 : EXT2_ET_INVALID_ARGUMENT;
+        else if (!strcmp(tok, "bw") && !parse_size(val, &v))
+            sim_model.bandwidth = v;
+        else if (!strcmp(tok, "stripe") && !parse_size(val, &v))
+            sim_model.stripe = v;
+        else if (!strcmp(tok, "disks"))
+            retval = (sim_model.disks = atoi(val)) > 0 && sim_model.disks <= SIM_MAX_DISKS ? 0 : EXT2_ET_INVALID_ARGUMENT;
+        else
+            retval = EXT2_ET_INVALID_ARGUMENT;
+    }
+
+    ext2fs_free_mem(&buf);
+    if (!retval)
+        sim_enabled = 1;
+    return retval;
+}
+
+/* 整个阵列的字节数, 决定寻道距离的比例 */
+void sim_set_capacity(__u64 bytes) {
+    pthread_mutex_lock(&sim_lock);
+    sim_model.capacity = bytes / sim_model.disks;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+static double disk_cost(struct sim_disk *d, __u64 offset, __u64 size) {
+    __u64 dist = offset > d->head ? offset - d->head : d->head - offset;
+    double ms = 0;
+
+    if (dist) {
+        ms = sim_model.seek_min + (sim_model.seek_max - sim_model.seek_min)
+             * sqrt(sim_model.capacity ? fmin(1.0, (double)dist / sim_model.capacity) : 1.0);
+        ms += 30000.0 / sim_model.rpm; // 平均半圈
+        sim_seeks++;
+    }
+    d->head = offset + size;
+    return ms / 1000 + size / sim_model.bandwidth;
+}
+
+/*
+ * 记一次请求. With delay the caller sleeps until the slowest member disk
+ * has finished it, requests of several threads queue per disk.
+ */
+void sim_account(__u64 offset, __u64 size, int write) {
+    struct timespec ts;
+    __u64 n, stripe_no, local;
+    double cost, now = 0, wait = 0, start;
+    struct sim_disk *d;
+
+    if (!sim_enabled || !size)
+        return;
+
+    pthread_mutex_lock(&sim_lock);
+    if (!sim_requests)
+        sim_start = sim_now();
+    if (sim_model.delay)
+        now = sim_now();
+    sim_requests++;
+    if (write)
+        sim_written += size;
+    else
+        sim_read += size;
+
+    while (size) {
+        if (sim_model.disks > 1) {
+            stripe_no = offset / sim_model.stripe;
+            d = sim_disks + stripe_no % sim_model.disks;
+            local = stripe_no / sim_model.disks * sim_model.stripe + offset % sim_model.stripe;
+            n = sim_model.stripe - offset % sim_model.stripe;
+            if (n > size)
+                n = size;
+        } else {
+            d = sim_disks;
+            local = offset;
+            n = size;
+        }
+
+        cost = disk_cost(d, local, n);
+        d->busy += cost;
+        if (sim_model.delay) {
+            start = d->busy_until > now ? d->busy_until : now;
+            d->busy_until = start + cost;
+            if (d->busy_until - now > wait)
+                wait = d->busy_until - now;
+        }
+        offset += n;
+        size -= n;
+    }
+    pthread_mutex_unlock(&sim_lock);
+
+    if (wait > 0) {
+        ts.tv_sec = (time_t)wait;
+        ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* 模拟时间取最忙的那块盘, 各盘并行工作 */
+void sim_summary(char *buf, size_t size) {
+    double busy = 0;
+    int i;
+
+    pthread_mutex_lock(&sim_lock);
+    for (i = 0; i < sim_model.disks; i++)
+        if (sim_disks[i].busy > busy)
+            busy = sim_disks[i].busy;
+    snprintf(buf, size, "Simulated disk time %.1f s (%llu requests, %llu seeks, %.1f MB read, %.1f MB written), wall %.1f s",
+             busy, (unsigned long long)sim_requests, (unsigned long long)sim_seeks, sim_read / 1048576.0,
+             sim_written / 1048576.0, sim_requests ? sim_now() - sim_start : 0.0);
+    pthread_mutex_unlock(&sim_lock);
+}
+
+static struct struct_io_manager struct_sim_manager;
+io_manager sim_io_manager = &struct_sim_manager;
+
+static errcode_t sim_open(const char *name, int flags, io_channel *channel) {
+    struct sim_private_data *data = NULL;
+    io_channel io = NULL;
+    errcode_t retval;
+
+    if (name == 0)
+        return EXT2_ET_BAD_DEVICE_NAME;
+    if (!sim_io_backing)
+        sim_io_backing = unix_io_manager;
+
+    if (retval = ext2fs_get_memzero(sizeof(struct struct_io_channel), &io))
+        return retval;
+    if (retval = ext2fs_get_memzero(sizeof(struct sim_private_data), &data))
+        goto _error;
+    if (retval = ext2fs_get_mem(strlen(name) + 1, &io->name))
+        goto _error;
+    strcpy(io->name, name);
+    if (retval = sim_io_backing->open(name, flags, &data->real))
+        goto _error;
+
+    io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+    io->manager = sim_io_manager;
+    io->block_size = data->real->block_size;
+    io->refcount = 1;
+    io->flags = data->real->flags;
+    io->private_data = data;
+
+    *channel = io;
+    return 0;
+
+_error:
+    if (io)
+        ext2fs_free_mem(&io->name);
+    ext2fs_free_mem(&data);
+    ext2fs_free_mem(&io);
+    return retval;
+}
+
+static errcode_t sim_close(io_channel channel) {
+    struct sim_private_data *data = channel->private_data;
+    errcode_t retval;
+
+    if (--channel->refcount > 0)
+        return 0;
+
+    retval = io_channel_close(data->real);
+    ext2fs_free_mem(&channel->private_data);
+    ext2fs_free_mem(&channel->name);
+    ext2fs_free_mem(&channel);
+    return retval;
+}
+
+static errcode_t sim_set_blksize(io_channel channel, int blksize) {
+    struct sim_private_data *data = channel->private_data;
+
+    channel->block_size = blksize;
+    return io_channel_set_blksize(data->real, blksize);
+}
+
+static __u64 request_size(io_channel channel, int count) {
+    return count < 0 ? (__u64)-count : (__u64)count * channel->block_size;
+}
+
+static errcode_t sim_read_blk64(io_channel channel, unsigned long long block, int count, void *buf) {
+    struct sim_private_data *data = channel->private_data;
+
+    sim_account(block * channel->block_size, request_size(channel, count), 0);
+    return io_channel_read_blk64(data->real, block, count, buf);
+}
+
+static errcode_t sim_read_blk(io_channel channel, unsigned long block, int count, void *buf) {
+    return sim_read_blk64(channel, block, count, buf);
+}
+
+static errcode_t sim_write_blk64(io_channel channel, unsigned long long block, int count, const void *buf) {
+    struct sim_private_data *data = channel->private_data;
+
+    sim_account(block * channel->block_size, request_size(channel, count), 1);
+    return io_channel_write_blk64(data->real, block, count, buf);
+}
+
+static errcode_t sim_write_blk(io_channel channel, unsigned long block, int count, const void *buf) {
+    return sim_write_blk64(channel, block, count, buf);
+}
+
+static errcode_t sim_write_byte(io_channel channel, unsigned long offset, int size, const void *buf) {
+    struct sim_private_data *data = channel->private_data;
+
+    sim_account(offset, size, 1);
+    return io_channel_write_byte(data->real, offset, size, buf);
+}
+
+static errcode_t sim_flush(io_channel channel) {
+    struct sim_private_data *data = channel->private_data;
+
+    return io_channel_flush(data->real);
+}
+
+static errcode_t sim_set_option(io_channel channel, const char *option, const char *arg) {
+    struct sim_private_data *data = channel->private_data;
+
+    if (!data->real->manager->set_option)
+        return EXT2_ET_INVALID_ARGUMENT;
+    return data->real->manager->set_option(data->real, option, arg);
+}
+
+static errcode_t sim_get_stats(io_channel channel, io_stats *stats) {
+    struct sim_private_data *data = channel->private_data;
+
+    if (!data->real->manager->get_stats)
+        return EXT2_ET_UNIMPLEMENTED;
+    return data->real->manager->get_stats(data->real, stats);
+}
+
+static errcode_t sim_discard(io_channel channel, unsigned long long block, unsigned long long count) {
+    struct sim_private_data *data = channel->private_data;
+
+    return io_channel_discard(data->real, block, count);
+}
+
+static errcode_t sim_cache_readahead(io_channel channel, unsigned long long block, unsigned long long count) {
+    struct sim_private_data *data = channel->private_data;
+
+    return io_channel_cache_readahead(data->real, block, count);
+}
+
+static errcode_t sim_zeroout(io_channel channel, unsigned long long block, unsigned long long count) {
+    struct sim_private_data *data = channel->private_data;
+
+    sim_account(block * channel->block_size, count * channel->block_size, 1);
+    return io_channel_zeroout(data->real, block, count);
+}
+
+static struct struct_io_manager struct_sim_manager = {
+    .magic = EXT2_ET_MAGIC_IO_MANAGER,
+    .name = "Seek simulating I/O Manager",
+    .open = sim_open,
+    .close = sim_close,
+    .set_blksize = sim_set_blksize,
+    .read_blk = sim_read_blk,
+    .write_blk = sim_write_blk,
+    .flush = sim_flush,
+    .write_byte = sim_write_byte,
+    .set_option = sim_set_option,
+    .get_stats = sim_get_stats,
+    .read_blk64 = sim_read_blk64,
+    .write_blk64 = sim_write_blk64,
+    .discard = sim_discard,
+    .cache_readahead = sim_cache_readahead,
+    .zeroout = sim_zeroout,
+};
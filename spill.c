@@ -0,0 +1,355 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "e2blk.h"
+
+/*
+ * 内存预算与磁盘溢出
+ *
+ * The large arrays (extent index, parent map, move plan) are allocated
+ * through spill_*_array. While the heap arrays stay under `mem_limit` they
+ * are plain heap memory; an array that would go over it is moved to an
+ * unlinked file in `spill_dir` and mapped shared, so the kernel writes its
+ * pages back to scratch space under pressure instead of the process being
+ * OOM-killed. Sorting large record sets goes through sorted run files
+ * merged into one mapped array (spill_write_run, spill_merge_runs).
+ */
+
+unsigned long long mem_limit = 0; // bytes, 0 is unlimited
+const char *spill_dir = NULL;
+
+struct spill_region {
+    void *addr;
+    size_t len;
+    int fd; // -1 for heap memory
+};
+
+static pthread_mutex_t spill_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct spill_region *regions = NULL;
+static int nregions = 0, regions_size = 0;
+static __u64 heap_bytes = 0;
+
+static const char *scratch_dir(void) {
+    const char *dir = spill_dir ? spill_dir : getenv("TMPDIR");
+
+    return dir ? dir : "/var/tmp";
+}
+
+/* 不留名字的临时文件, 进程退出后自动回收 */
+static int scratch_open(void) {
+    const char *dir = scratch_dir();
+    char *path;
+    int fd;
+
+    fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL))
+        return fd;
+
+    if (ext2fs_get_mem(strlen(dir) + 16, &path))
+        return -1;
+    sprintf(path, "%s/e2blk.XXXXXX", dir);
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd >= 0)
+        unlink(path);
+    ext2fs_free_mem(&path);
+    return fd;
+}
+
+static struct spill_region *find_region(void *addr) {
+    int i;
+
+    for (i = 0; i < nregions; i++)
+        if (regions[i].addr == addr)
+            return regions + i;
+    return NULL;
+}
+
+static errcode_t add_region(void *addr, size_t len, int fd) {
+    errcode_t retval;
+
+    if (nregions == regions_size) {
+        int size = regions_size ? regions_size * 2 : 16;
+        if (retval = ext2fs_resize_array(sizeof(struct spill_region), regions_size, size, &regions))
+            return retval;
+        regions_size = size;
+    }
+    regions[nregions].addr = addr;
+    regions[nregions].len = len;
+    regions[nregions].fd = fd;
+    nregions++;
+    return 0;
+}
+
+static void del_region(struct spill_region *r) {
+    *r = regions[--nregions];
+}
+
+/* 新建一个 `len` 字节的文件映射, 内容为0 */
+static errcode_t map_scratch(size_t len, void **addr, int *fdp) {
+    errcode_t retval;
+    int fd = scratch_open();
+
+    if (fd < 0)
+        return errno;
+    if (ftruncate(fd, len) < 0) {
+        retval = errno;
+        close(fd);
+        return retval;
+    }
+    *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (*addr == MAP_FAILED) {
+        retval = errno;
+        close(fd);
+        return retval;
+    }
+    *fdp = fd;
+    return 0;
+}
+
+static errcode_t grow_mapping(struct spill_region *r, size_t len) {
+    void *addr;
+
+    if (ftruncate(r->fd, len) < 0)
+        return errno;
+    addr = mremap(r->addr, r->len, len, MREMAP_MAYMOVE);
+    if (addr == MAP_FAILED)
+        return errno;
+    r->addr = addr;
+    r->len = len;
+    return 0;
+}
+
+/*
+ * 同 ext2fs_resize_array, but the array moves to a scratch file mapping
+ * once the heap arrays would exceed mem_limit. New elements are zero.
+ */
+errcode_t spill_resize_array(unsigned long size, unsigned long long old_count,
+                             unsigned long long count, void *ptr) {
+    void **p = (void **)ptr, *addr;
+    size_t old_len = size * old_count, len = size * count;
+    struct spill_region *r;
+    errcode_t retval = 0;
+    int fd;
+
+    pthread_mutex_lock(&spill_lock);
+    r = *p ? find_region(*p) : NULL;
+
+    if (r && r->fd >= 0) {
+        if (len > r->len)
+            retval = grow_mapping(r, len);
+        if (!retval)
+            *p = r->addr;
+        goto _unlock;
+    }
+
+    if (!mem_limit || heap_bytes - (r ? r->len : 0) + len <= mem_limit || len <= old_len) {
+        addr = *p;
+        if (retval = ext2fs_resize_array(size, old_count, count, &addr))
+            goto _unlock;
+        if (len > old_len)
+            memset((char *)addr + old_len, 0, len - old_len);
+        if (r) {
+            heap_bytes += len - r->len;
+            r->addr = addr;
+            r->len = len;
+        } else if (retval = add_region(addr, len, -1)) {
+            /* 不能记录就当作普通内存, 释放时仍然正确 */
+            retval = 0;
+        } else
+            heap_bytes += len;
+        *p = addr;
+        goto _unlock;
+    }
+
+    /* 超出预算, 搬到磁盘 */
+    if (retval = map_scratch(len, &addr, &fd))
+        goto _unlock;
+    if (old_len)
+        memcpy(addr, *p, old_len);
+    if (r) {
+        heap_bytes -= r->len;
+        ext2fs_free_mem(p);
+        r->addr = addr;
+        r->len = len;
+        r->fd = fd;
+    } else {
+        ext2fs_free_mem(p);
+        if (retval = add_region(addr, len, fd)) {
+            munmap(addr, len);
+            close(fd);
+            goto _unlock;
+        }
+    }
+    *p = addr;
+
+_unlock:
+    pthread_mutex_unlock(&spill_lock);
+    return retval;
+}
+
+errcode_t spill_get_arrayzero(unsigned long size, unsigned long long count, void *ptr) {
+    *(void **)ptr = NULL;
+    return spill_resize_array(size, 0, count, ptr);
+}
+
+void spill_free(void *ptr) {
+    void **p = (void **)ptr;
+    struct spill_region *r;
+
+    if (!*p)
+        return;
+    pthread_mutex_lock(&spill_lock);
+    r = find_region(*p);
+    if (r && r->fd >= 0) {
+        munmap(r->addr, r->len);
+        close(r->fd);
+        del_region(r);
+        *p = NULL;
+    } else {
+        if (r) {
+            heap_bytes -= r->len;
+            del_region(r);
+        }
+        ext2fs_free_mem(p);
+    }
+    pthread_mutex_unlock(&spill_lock);
+}
+
+/* 排序缓冲区的大小, 0表示不需要分段 */
+__u64 spill_run_bytes(void) {
+    return mem_limit / 4;
+}
+
+/* 把已排序的 `count` 条记录写成一个分段文件 */
+errcode_t spill_write_run(struct spill_runs *sr, const void *recs, __u64 count) {
+    size_t len = sr->rec_size * count;
+    errcode_t retval;
+    ssize_t n;
+    size_t off;
+    int fd;
+
+    if (sr->nruns == sr->size) {
+        int size = sr->size ? sr->size * 2 : 16;
+        if ((retval = ext2fs_resize_array(sizeof(int), sr->size, size, &sr->fds))
+            || (retval = ext2fs_resize_array(sizeof(__u64), sr->size, size, &sr->counts)))
+            return retval;
+        sr->size = size;
+    }
+
+    fd = scratch_open();
+    if (fd < 0)
+        return errno;
+    for (off = 0; off < len; off += n) {
+        n = write(fd, (const char *)recs + off, len - off);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+        if (n <= 0) {
+            retval = n < 0 ? errno : EXT2_ET_SHORT_WRITE;
+            close(fd);
+            return retval;
+        }
+    }
+
+    sr->fds[sr->nruns] = fd;
+    sr->counts[sr->nruns] = count;
+    sr->nruns++;
+    sr->total += count;
+    return 0;
+}
+
+struct merge_context {
+    char **base;  // mapped runs
+    __u64 *pos;   // next record of each run
+    size_t rec_size;
+    int (*cmp)(const void *, const void *);
+};
+
+#define RUN_REC(m, i) ((m)->base[i] + (m)->pos[i] * (m)->rec_size)
+
+/* 按各分段的当前记录维护的小顶堆 */
+static void sift_down(struct merge_context *m, int *heap, int n, int i) {
+    int c, t;
+
+    for (;;) {
+        c = 2 * i + 1;
+        if (c >= n)
+            break;
+        if (c + 1 < n && m->cmp(RUN_REC(m, heap[c + 1]), RUN_REC(m, heap[c])) < 0)
+            c++;
+        if (m->cmp(RUN_REC(m, heap[c]), RUN_REC(m, heap[i])) >= 0)
+            break;
+        t = heap[i];
+        heap[i] = heap[c];
+        heap[c] = t;
+        i = c;
+    }
+}
+
+/*
+ * 多路归并所有分段到一个新数组 (spill_get_arrayzero, so it is a scratch
+ * mapping when over the budget). Runs are mapped read-only and read once
+ * in order.
+ */
+errcode_t spill_merge_runs(struct spill_runs *sr, int (*cmp)(const void *, const void *), void **ret) {
+    struct merge_context m = {NULL, NULL, sr->rec_size, cmp};
+    char *out = NULL;
+    int *heap = NULL, i, n = 0;
+    errcode_t retval;
+    __u64 o;
+
+    if ((retval = ext2fs_get_arrayzero(sr->nruns, sizeof(char *), &m.base))
+        || (retval = ext2fs_get_arrayzero(sr->nruns, sizeof(__u64), &m.pos))
+        || (retval = ext2fs_get_arrayzero(sr->nruns, sizeof(int), &heap))
+        || (retval = spill_get_arrayzero(sr->rec_size, sr->total, &out)))
+        goto _free;
+
+    for (i = 0; i < sr->nruns; i++) {
+        if (!sr->counts[i])
+            continue;
+        m.base[i] = mmap(NULL, sr->rec_size * sr->counts[i], PROT_READ, MAP_PRIVATE, sr->fds[i], 0);
+        if (m.base[i] == MAP_FAILED) {
+            retval = errno;
+            m.base[i] = NULL;
+            goto _free;
+        }
+        madvise(m.base[i], sr->rec_size * sr->counts[i], MADV_SEQUENTIAL);
+        heap[n++] = i;
+    }
+    for (i = n / 2 - 1; i >= 0; i--)
+        sift_down(&m, heap, n, i);
+
+    for (o = 0; n; o++) {
+        i = heap[0];
+        memcpy(out + o * sr->rec_size, RUN_REC(&m, i), sr->rec_size);
+        if (++m.pos[i] == sr->counts[i])
+            heap[0] = heap[--n];
+        sift_down(&m, heap, n, 0);
+    }
+
+    *ret = out;
+    out = NULL;
+
+_free:
+    for (i = 0; m.base && i < sr->nruns; i++)
+        if (m.base[i])
+            munmap(m.base[i], sr->rec_size * sr->counts[i]);
+    spill_free(&out);
+    ext2fs_free_mem(&m.base);
+    ext2fs_free_mem(&m.pos);
+    ext2fs_free_mem(&heap);
+    return retval;
+}
+
+void spill_runs_free(struct spill_runs *sr) {
+    int i;
+
+    for (i = 0; i < sr->nruns; i++)
+        close(sr->fds[i]);
+    ext2fs_free_mem(&sr->fds);
+    ext2fs_free_mem(&sr->counts);
+    sr->nruns = sr->size = 0;
+    sr->total = 0;
+}
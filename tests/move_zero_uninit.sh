@@ -0,0 +1,60 @@
+#!/bin/sh
+# 移动带全0段的depth 1 extent文件 (-z): the zero run must end up as an
+# unwritten extent at its destination, every other block must keep its
+# data and e2fsck must find the filesystem clean.
+#
+# usage: move_zero_uninit.sh path/to/e2blk
+# Needs mke2fs, debugfs, e2fsck, python3 and script(1); the move screen is
+# driven through a pseudo terminal.
+
+set -e
+E2BLK=$1
+BS=4096
+OFFSET=16M
+LOW_BLOCKS=4096 # 16M / 4K
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+truncate -s 64M img
+mke2fs -q -F -t ext4 -b $BS img
+
+# 12 runs of 4 blocks with holes between them: more extents than fit in
+# the inode, so the tree has depth 1
+python3 - <<'PY'
+import os
+with open('data', 'wb') as f:
+    for i in range(12):
+        f.seek(i * 8 * 4096)
+        f.write(os.urandom(4 * 4096))
+PY
+debugfs -w -R "write data f" img >/dev/null 2>&1
+debugfs -R "ex f" img 2>/dev/null | grep -q '^ 1/ 1' || { echo "extent tree of f has no depth 1"; exit 1; }
+
+# 逻辑块16-19改写为0, 直接写盘上的物理块 (debugfs write would punch them)
+pblk=$(debugfs -R "bmap f 16" img 2>/dev/null)
+dd if=/dev/zero of=img bs=$BS seek="$pblk" count=4 conv=notrunc status=none
+dd if=/dev/zero of=data bs=$BS seek=16 count=4 conv=notrunc status=none
+[ "$pblk" -lt $LOW_BLOCKS ] || { echo "f is not in the region to clear"; exit 1; }
+
+{
+    sleep 2; printf 'm'
+    sleep 1; printf '%s\n' $OFFSET
+    sleep 3; printf 'y'
+    sleep 5; printf 'q'
+    sleep 1; printf 'q'
+} | TERM=xterm script -qec "'$E2BLK' -z -f img" /dev/null >/dev/null
+
+e2fsck -fn img >fsck.log 2>&1 || { cat fsck.log; echo "e2fsck found errors"; exit 1; }
+
+debugfs -R "dump f out" img >/dev/null 2>&1
+cmp data out || { echo "contents of f changed"; exit 1; }
+
+debugfs -R "ex f" img 2>/dev/null >extents
+awk -v low=$LOW_BLOCKS '$1 == "1/" && $8 + 0 < low { bad = 1 } END { exit bad }' extents \
+    || { cat extents; echo "f still has blocks below $OFFSET"; exit 1; }
+grep -E '^ 1/ 1 +[0-9]+/ +[0-9]+ +16 - +19 .*Uninit' extents >/dev/null \
+    || { cat extents; echo "zero run of f is not unwritten"; exit 1; }
+
+echo ok
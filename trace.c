@@ -0,0 +1,92 @@
+#include <stdarg.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "e2blk.h"
+
+/*
+ * 时间线导出
+ *
+ * Writes Chrome trace-event JSON (complete "X" events and thread_name
+ * metadata) that chrome://tracing and Perfetto load directly. Every span
+ * carries the kernel thread id of the thread it ran on. With no trace file
+ * open the calls return after one test.
+ */
+
+FILE *trace_file = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static __u64 trace_start;
+static int trace_events;
+
+static __u64 monotonic_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+errcode_t trace_open(const char *path) {
+    trace_file = fopen(path, "w");
+    if (!trace_file)
+        return errno;
+    trace_start = monotonic_us();
+    trace_events = 0;
+    fprintf(trace_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    trace_thread_name("main");
+    return 0;
+}
+
+void trace_close(void) {
+    if (!trace_file)
+        return;
+    pthread_mutex_lock(&trace_lock);
+    fprintf(trace_file, "\n]}\n");
+    fclose(trace_file);
+    trace_file = NULL;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+__u64 trace_now(void) {
+    return trace_file ? monotonic_us() - trace_start : 0;
+}
+
+static void trace_event(const char *fmt, ...) {
+    va_list args;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file) {
+        fprintf(trace_file, trace_events++ ? ",\n" : "\n");
+        va_start(args, fmt);
+        vfprintf(trace_file, fmt, args);
+        va_end(args);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_thread_name(const char *name) {
+    if (!trace_file)
+        return;
+    trace_event("{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":\"%s\"}}",
+                getpid(), (long)syscall(SYS_gettid), name);
+}
+
+/*
+ * 结束一个从 `start` (trace_now) 开始的区间. `fmt` formats the members of
+ * the args object, e.g. "\"ino\":%u", or is NULL.
+ */
+void trace_span(const char *cat, const char *name, __u64 start, const char *fmt, ...) {
+    char args[256] = "";
+    va_list ap;
+
+    if (!trace_file)
+        return;
+    if (fmt) {
+        va_start(ap, fmt);
+        vsnprintf(args, sizeof(args), fmt, ap);
+        va_end(ap);
+    }
+    trace_event("{\"ph\":\"X\",\"cat\":\"%s\",\"name\":\"%s\",\"pid\":%d,\"tid\":%ld,"
+                "\"ts\":%llu,\"dur\":%llu,\"args\":{%s}}",
+                cat, name, getpid(), (long)syscall(SYS_gettid),
+                (unsigned long long)start, (unsigned long long)(trace_now() - start), args);
+}
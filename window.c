@@ -97,6 +97,8 @@ static void render_default(int clear) {
         win_clear(stdscr, y + 2, 1, x - 2);
         win_clear(stdscr, y + 3, 1, x - 2);
         win_clear(stdscr, y + 4, 1, x - 2);
+        win_clear(stdscr, y + 5, 1, x - 2);
+        win_clear(stdscr, y + 6, 1, x - 2);
     } else {
         mvprintw(y + 0, x + 00, "Device name: %s", fs->device_name);
         mvprintw(y + 1, x + 00, "Mount count: %u", fs->super->s_mnt_count);
@@ -105,6 +107,14 @@ static void render_default(int clear) {
         mvprintw(y + 3, x + 25, "Free blocks: %llu", ext2fs_free_blocks_count(fs->super));
         mvprintw(y + 4, x + 00, "Inode count: %u", fs->super->s_inodes_count);
         mvprintw(y + 4, x + 25, "Free inodes: %u", fs->super->s_free_inodes_count);
+        if (fs_frag) {
+            mvprintw(y + 5, x + 00, "Files: %llu", fs_frag->files);
+            mvprintw(y + 5, x + 25, "Fragmented: %llu (%.1f%%, %.2f extents/file)", fs_frag->fragmented,
+                      fs_frag->files ? 100.0 * fs_frag->fragmented / fs_frag->files : 0.0,
+                      fs_frag->files ? (double)fs_frag->extents / fs_frag->files : 0.0);
+            mvprintw(y + 6, x + 00, "Free extents: %llu", fs_frag->free_runs);
+            mvprintw(y + 6, x + 25, "Largest free: %llu blocks", fs_frag->free_max);
+        }
     }
     move(y, x);
     refresh();
@@ -202,7 +212,7 @@ int readline(const char *promt, char *line, int len) {
             refresh();
             break;
         default:
-            if ((ch >= '0' && ch <= '9') || (ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z')) {
+            if (ch < 0x80 && isprint(ch)) {
                 if (i < len) {
                     addch(ch);
                     line[i++] = ch;
@@ -324,6 +334,10 @@ int init_ncurses() {
     init_pair(CP_EMP, COLOR_WHITE, COLOR_WHITE);
     init_pair(CP_DAT, COLOR_BLUE, COLOR_WHITE);
     init_pair(CP_HL, COLOR_YELLOW, COLOR_GREEN);
+    init_pair(CP_OVL, COLOR_MAGENTA, COLOR_WHITE);
+    init_pair(CP_JNL, COLOR_YELLOW, COLOR_WHITE);
+    init_pair(CP_DIR, COLOR_GREEN, COLOR_WHITE);
+    init_pair(CP_META, COLOR_CYAN, COLOR_WHITE);
     // bkgd((chtype)COLOR_PAIR(CP_BG));
 
     render_default(0);